@@ -8,6 +8,7 @@ CHECK_INCLUDE_FILE_CXX(fcntl.h UNIX_HAVE_FCNTL)
 CHECK_INCLUDE_FILE_CXX(sys/prctl.h UNIX_HAVE_SYS_PRCTL)
 CHECK_INCLUDE_FILE_CXX(sys/inotify.h UNIX_HAVE_SYS_INOTIFY)
 CHECK_INCLUDE_FILE_CXX(sys/mman.h UNIX_HAVE_SYS_MMAN)
+CHECK_INCLUDE_FILE_CXX(linux/futex.h UNIX_HAVE_LINUX_FUTEX)
 
 CHECK_FUNCTION_EXISTS(read UNIX_HAVE_READ)
 CHECK_FUNCTION_EXISTS(write UNIX_HAVE_WRITE)
@@ -35,14 +35,49 @@ namespace
         log_INFO(buffer);
         snprintf(buffer, bsize, "\tUse Inotify: %s", globalConfig.useInotify ? "True" : "False");
         log_INFO(buffer);
+        snprintf(buffer,
+                 bsize,
+                 "\tWatch Mode: %s, debounce: %d ms",
+                 globalConfig.watch ? "True" : "False",
+                 globalConfig.watchDebounce);
+        log_INFO(buffer);
         snprintf(buffer, bsize, "\tUID: %d, GID: %d", globalConfig.uid, globalConfig.gid);
         log_INFO(buffer);
+        snprintf(buffer,
+                 bsize,
+                 "\tWrite product pictures: %s",
+                 globalConfig.writeProducts ? "True" : "False");
+        log_INFO(buffer);
         snprintf(buffer,
                  bsize,
                  "\tWill forkToBackground: %s, workerThreadCount: %d",
                  globalConfig.forkToBackground ? "True" : "False",
                  globalConfig.threadCount);
         log_INFO(buffer);
+        snprintf(buffer,
+                 bsize,
+                 "\twalkerThreadCount: %d, decoderThreadCount: %d, executorThreads: %d",
+                 globalConfig.walkerThreadCount,
+                 globalConfig.decoderThreadCount,
+                 globalConfig.executorThreads);
+        log_INFO(buffer);
+        snprintf(buffer, bsize, "\tshutdownTimeout: %d ms", globalConfig.shutdownTimeout);
+        log_INFO(buffer);
+        snprintf(buffer,
+                 bsize,
+                 "\tqueueLength: %d, memoryBudget: %lu MiB, imagePool: %lu MiB",
+                 globalConfig.queueLength,
+                 globalConfig.memoryBudget >> 20,
+                 globalConfig.imagePool >> 20);
+        log_INFO(buffer);
+        if (globalConfig.metricsPath != "") {
+            snprintf(buffer,
+                     bsize,
+                     "\tmetricsFile: %s, every %d s",
+                     globalConfig.metricsPath.c_str(),
+                     globalConfig.metricsInterval);
+            log_INFO(buffer);
+        }
     }
 
     LogSeverity intToSeverity(int i)
@@ -277,23 +312,64 @@ void StartSystem(const Json::Value &jsonRoot)
     string rawDir = "";
     string productDir = "";
     bool useInotify;
+    bool watch = false;
+    int debounce = 2000;
     int uid, gid;
     int workCount;
+    int walkerCount = 4;
+    int decoderCount = 2;
+    int executorCount = 0;
+    int shutdownTimeout = 30000;
+    int queueLength = 64;
+    int budget = 2048;
+    int imagePool = 512;
+    string metrics = "";
+    int metricsInterval = 10;
     auto &root = jsonRoot["system"];
     getValue(rootDirectory, root, String, dir, "./");
     getValue(useInotify, root, Bool, useInotify, true);
+    getValue(watch, root, Bool, watch, false);
+    getValue(watchDebounce, root, Int, debounce, 2000);
     getValue(gid, root, Int, gid, -1);
     getValue(uid, root, Int, uid, -1);
     getValue(rawDirectory, root, String, rawDir, "./");
     getValue(productDirectory, root, String, productDir, "./");
     getValue(workerThreadCount, root, Int, workCount, 5);
+    getValue(walkerThreadCount, root, Int, walkerCount, 4);
+    getValue(decoderThreadCount, root, Int, decoderCount, 2);
+    getValue(executorThreads, root, Int, executorCount, 0);
+    getValue(shutdownTimeout, root, Int, shutdownTimeout, 30000);
+    getValue(queueLength, root, Int, queueLength, 64);
+    getValue(memoryBudget, root, Int, budget, 2048);
+    getValue(imagePool, root, Int, imagePool, 512);
     getValue(delete, root, Bool, globalConfig.deleteRaw, false);
+    getValue(writeProducts, root, Bool, globalConfig.writeProducts, true);
+    getValue(journal, root, String, globalConfig.journalPath, "");
+    getValue(metricsFile, root, String, metrics, "");
+    getValue(metricsInterval, root, Int, metricsInterval, 10);
 
     globalConfig.threadCount = workCount;
+    globalConfig.walkerThreadCount = walkerCount;
+    globalConfig.decoderThreadCount = decoderCount;
+    globalConfig.executorThreads = executorCount;
+    globalConfig.shutdownTimeout = shutdownTimeout < 0 ? 0 : shutdownTimeout;
+    globalConfig.queueLength = queueLength;
+    globalConfig.memoryBudget = budget < 0 ? 0 : static_cast<size_t>(budget) << 20;
+    globalConfig.imagePool = imagePool < 0 ? 0 : static_cast<size_t>(imagePool) << 20;
     globalConfig.rootPath = (dir);
     globalConfig.uid = uid;
     globalConfig.gid = gid;
     globalConfig.useInotify = useInotify;
+    globalConfig.watch = watch;
+    globalConfig.watchDebounce = debounce;
+    fc::ProcessedJournal::initJournal(globalConfig.journalPath.c_str());
+    if (metrics != "") {
+        // resolved now, the process changes its working directory later on
+        globalConfig.metricsPath = boost::filesystem::absolute(metrics).native();
+    }
+    globalConfig.metricsInterval = metricsInterval <= 0 ? 10 : metricsInterval;
+    tb::metrics::Registry::getRegistry().startReporter(globalConfig.metricsPath.c_str(),
+                                                       globalConfig.metricsInterval);
 
     char currentD[512];
     char next[512];
@@ -310,9 +386,12 @@ void StartSystem(const Json::Value &jsonRoot)
     char *buffer = requestMemory(bsize);
 #ifdef USE_INOTIFY
     if (useInotify) {
-        globalConfig.inotifyFD = inotify_init();
+        globalConfig.inotifyFD = inotify_init1(IN_CLOEXEC);
+        if (globalConfig.inotifyFD == -1) {
+            snprintf(buffer, bsize, "inotify_init failed: %s", strerror(errno));
+            log_ERROR(buffer);
+        }
     }
-    inotify_add_watch(globalConfig.inotifyFD, dir.c_str(), IN_CREATE | IN_MODIFY | IN_ONLYDIR);
 #endif
 
     const auto pro = globalConfig.productPath.c_str();
@@ -400,7 +479,39 @@ void fcInit(const char *json)
     fc::ImageProcessingStartup(root);
 
     auto image = root["image"];
+    auto ocr = image["ocr"];
+    bool reducedDecode = true;
+    int detectWidth = 0;
+    int concurrency = 4;
     getValue(destWidth, image, Int, globalConfig.destWidth, 700);
+    getValue(reducedDecode, image, Bool, reducedDecode, true);
+    globalConfig.reducedDecode = reducedDecode;
+    getValue(barcodeDetectWidth, image, Int, detectWidth, 0);
+    globalConfig.barcodeDetectWidth = detectWidth < 0 ? 0 : detectWidth;
+    getValue(concurrency, ocr, Int, concurrency, 4);
+    globalConfig.ocrConcurrency = concurrency > 0 ? concurrency : 1;
+    auto retry = ocr["retry"];
+    int baseDelay = 500, maxDelay = 30000, maxPending = 256;
+    double jitter = 0.2;
+    getValue(baseDelay, retry, Int, baseDelay, 500);
+    getValue(maxDelay, retry, Int, maxDelay, 30000);
+    getValue(jitter, retry, Double, jitter, 0.2);
+    getValue(maxPending, retry, Int, maxPending, 256);
+    globalConfig.ocrRetryBase = baseDelay > 0 ? baseDelay : 500;
+    globalConfig.ocrRetryMax = std::max(maxDelay, globalConfig.ocrRetryBase);
+    globalConfig.ocrRetryJitter = jitter < 0 ? 0 : (jitter > 1 ? 1 : jitter);
+    globalConfig.ocrRetryMaxPending = maxPending < 0 ? 0 : maxPending;
+    char info[128];
+    snprintf(info, 128, "\tOCR requests in flight: %d", globalConfig.ocrConcurrency);
+    log_INFO(info);
+    snprintf(info,
+             128,
+             "\tOCR retry: %d ms doubling up to %d ms, jitter %.2f, intake held at %d pending",
+             globalConfig.ocrRetryBase,
+             globalConfig.ocrRetryMax,
+             globalConfig.ocrRetryJitter,
+             globalConfig.ocrRetryMaxPending);
+    log_INFO(info);
     getValue(jpgQuality, image, Int, globalConfig.jpgQuality, 95);
     if (globalConfig.destWidth > 1000 || globalConfig.destWidth < 0) {
         globalConfig.destWidth = 700;
@@ -408,6 +519,27 @@ void fcInit(const char *json)
     if (globalConfig.jpgQuality > 100 || globalConfig.jpgQuality < 0) {
         globalConfig.jpgQuality = 95;
     }
+    auto jpeg = image["jpeg"];
+    string subsampling = "420";
+    bool optimize = false, progressive = false;
+    getValue(subsampling, jpeg, String, subsampling, "420");
+    getValue(optimize, jpeg, Bool, optimize, false);
+    getValue(progressive, jpeg, Bool, progressive, false);
+    globalConfig.jpeg.quality = globalConfig.jpgQuality;
+    if (!tb::jpeg::parseSubsampling(subsampling.c_str(), globalConfig.jpeg.sampling)) {
+        log_WARNING("image.jpeg.subsampling must be 444, 422 or 420, assume 420.");
+        globalConfig.jpeg.sampling = tb::jpeg::SAMP_420;
+    }
+    globalConfig.jpeg.optimize = optimize;
+    globalConfig.jpeg.progressive = progressive;
+    snprintf(info,
+             128,
+             "\tJPEG quality %d, subsampling %s, optimize %s, progressive %s",
+             globalConfig.jpeg.quality,
+             subsampling.c_str(),
+             optimize ? "True" : "False",
+             progressive ? "True" : "False");
+    log_INFO(info);
     tb::utils::destroyFile(buffer, size, &error);
     delete r;
 }
@@ -444,8 +576,28 @@ void SystemConfig::buildDefaultSystemConfig()
     g.rootPath = g.rawPath = g.productPath = g.mysqlAddress = g.mysqlUserName = g.mysqlPassword =
         g.mysqlDB = std::string(20, ' ');
     g.mysqlEnable = g.useInotify = g.mysqlCompress = true;
+    g.watch = false;
+    g.watchDebounce = 2000;
     g.uid = g.gid = -1;
     g.threadCount = 1;
+    g.ocrConcurrency = 4;
+    g.ocrRetryBase = 500;
+    g.ocrRetryMax = 30000;
+    g.ocrRetryJitter = 0.2;
+    g.ocrRetryMaxPending = 256;
+    g.walkerThreadCount = 4;
+    g.decoderThreadCount = 2;
+    g.executorThreads = 0;
+    g.shutdownTimeout = 30000;
+    g.queueLength = 64;
+    g.memoryBudget = 2048ul << 20;
+    g.imagePool = 512ul << 20;
+    g.reducedDecode = true;
+    g.barcodeDetectWidth = 0;
+    g.writeProducts = true;
+    g.destWidth = 700;
+    g.jpgQuality = 95;
+    g.metricsInterval = 10;
 }
 
 #undef getValue
@@ -1,10 +1,14 @@
 
 #include "fchecker.h"
+#include "id.h"
 #include "logger.h"
+#include "matpool.h"
 #include "remote.h"
 
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <algorithm>
+#include <cmath>
 #include <cstdlib>
 #include <ctime>
 #include <iostream>
@@ -16,7 +20,125 @@ using std::vector;
 
 namespace
 {
-    int getNumber(const char* s)
+    bool writeBuffer(const char* name, const vector<uint8_t>& data)
+    {
+        if (data.empty()) {
+            return false;
+        }
+        int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t n = write(fd, data.data() + done, data.size() - done);
+            if (n <= 0) {
+                break;
+            }
+            done += n;
+        }
+        close(fd);
+        return done == data.size();
+    }
+}  // namespace
+
+SystemConfig globalConfig;
+
+namespace fc
+{
+    FcHandler* FcHandler::instance = nullptr;
+    ItemSchedular* ItemSchedular::instance = nullptr;
+
+    // MemoryBudget ==================
+    MemoryBudget::MemoryBudget(size_t _l) : limit(_l), used(0), peak(0), waits(0) {}
+
+    void MemoryBudget::setLimit(size_t _l)
+    {
+        _m.lock();
+        limit = _l;
+        _cv.notify_all();
+        _m.unlock();
+    }
+
+    bool MemoryBudget::wait()
+    {
+        bool waited = false;
+        _cv.wait(_m, [&] {
+            bool ok = limit == 0 || used < limit;
+            waited = waited || !ok;
+            return ok;
+        });
+        if (waited) {
+            waits++;
+        }
+        _m.unlock();
+        return waited;
+    }
+
+    void MemoryBudget::charge(size_t size)
+    {
+        _m.lock();
+        used += size;
+        peak = std::max(peak, used);
+        _m.unlock();
+    }
+
+    void MemoryBudget::release(size_t size)
+    {
+        _m.lock();
+        used -= std::min(used, size);
+        _cv.notify_all();
+        _m.unlock();
+    }
+
+    size_t MemoryBudget::getUsed()
+    {
+        _m.lock();
+        auto ret = used;
+        _m.unlock();
+        return ret;
+    }
+
+    size_t MemoryBudget::getPeak()
+    {
+        _m.lock();
+        auto ret = peak;
+        _m.unlock();
+        return ret;
+    }
+
+    size_t MemoryBudget::getLimit()
+    {
+        _m.lock();
+        auto ret = limit;
+        _m.unlock();
+        return ret;
+    }
+
+    size_t MemoryBudget::getWaits()
+    {
+        _m.lock();
+        auto ret = waits;
+        _m.unlock();
+        return ret;
+    }
+    // MemoryBudget END ====================
+
+    // FcHandler ==================
+    FcHandler::FcHandler(const SystemConfig& _config)
+        : config(_config),
+          itemSched(ItemSchedular::getSchedular()),
+          walker(_config.walkerThreadCount,
+                 [this](const string& dir, vector<string>& files) { AddFiles(dir, files); })
+    {
+    }
+
+    void FcHandler::AddDirectory(const char* p)
+    {
+        walker.walk(p);
+    }
+
+    int FcHandler::getNumber(const char* s)
     {
         int ret = 0;
         bool matchNumber = false;
@@ -48,122 +170,70 @@ namespace
         return ret;
     }
 
-    const unsigned long nameMax = 255;
-
-}  // namespace
-
-SystemConfig globalConfig;
-
-namespace fc
-{
-    FcHandler* FcHandler::instance = nullptr;
-    ItemSchedular* ItemSchedular::instance = nullptr;
-
-    // FcHandler ==================
-    FcHandler::FcHandler(const SystemConfig& _config)
-        : config(_config), itemSched(ItemSchedular::getSchedular())
+    void FcHandler::groupTriplets(vector<string>& files, vector<string>& rest)
     {
+        vector<std::pair<int, string>> numbered;
+        numbered.reserve(files.size());
+        for (auto& f : files) {
+            int n = getNumber(f.c_str());
+            numbered.emplace_back(n, std::move(f));
+        }
+        std::sort(numbered.begin(), numbered.end());
+        files.clear();
+        for (size_t i = 0; i < numbered.size();) {
+            int n = numbered[i].first;
+            if (n >= 0 && i + 2 < numbered.size() && numbered[i + 1].first == n + 1
+                && numbered[i + 2].first == n + 2) {
+                for (int k = 0; k < 3; k++) {
+                    files.emplace_back(std::move(numbered[i + k].second));
+                }
+                i += 3;
+            } else {
+                rest.emplace_back(std::move(numbered[i].second));
+                i++;
+            }
+        }
     }
 
-    void FcHandler::AddDirectory(const char* p)
+    void FcHandler::AddFiles(const string& parent, vector<string>& files)
     {
-        char* buffer = requestMemory(strlen(p) + 128);
-        DIR* dir = opendir(p);
-        if (dir == nullptr) {
-            sprintf(buffer, "Open Directory %s Failed: %s", p, strerror(errno));
+        vector<string> rest;
+        groupTriplets(files, rest);
+        if (rest.size() > 0) {
+            char* buffer = requestMemory(parent.length() + 128);
+            sprintf(buffer,
+                    "%lu images in directory %s do not form a triplet, skipped.",
+                    rest.size(),
+                    parent.c_str());
             log_ERROR(buffer);
-        } else {
-            sprintf(buffer, "Open Directory %s Success", p);
-            log_TRACE(buffer);
-            string path = p;
-            tb::utils::formatDirectoryPath(path);
-            p = stringDUP(path.c_str());
-            auto parent = std::make_shared<CharPointer>((p));
-            AddDirectory(dir, parent);
+            releaseMemory(buffer);
         }
-        releaseMemory(buffer);
-    }
-
-
-    void FcHandler::AddDirectory(DIR* dir, StringPointer& parent)
-    {
-        const int FNAME = 0;
-        const int NUMBER = 1;
-
-        using imgType = std::tuple<const char*, int>;
-        vector<imgType> IMGs;
-
-        auto parentPTR = parent.get()->pointer;
-        auto length = strlen(*parent.get());
-        string name;
-        do {
-            dirent* entry = readdir(dir);
-            if (entry == nullptr) {
-                break;
-            }
-            const char* fname = entry->d_name;
-            if (*fname == '.') {
-                continue;
-            } else {
-                if (strcmp(parentPTR, "") == 0) {
-                    name = fname;
-                } else {
-                    name = string(parentPTR) + "/" + fname;
+        auto journal = ProcessedJournal::getJournal();
+        int skipped = 0;
+        for (size_t i = 0; i < files.size(); i += 3) {
+            uint64_t keys[3] = {0, 0, 0};
+            if (journal != nullptr) {
+                bool done = true;
+                for (int k = 0; k < 3; k++) {
+                    if (ProcessedJournal::buildKey(files[i + k].c_str(), keys[k]) == -1
+                        || !journal->contains(keys[k])) {
+                        done = false;
+                    }
                 }
-                struct stat st;
-                int statRet = stat(name.c_str(), &st);
-                if (statRet == -1) {
-                    char* buffer = requestMemory(length + nameMax + 128);
-                    sprintf(buffer,
-                            "System Call \"stat\" failed with file %s: %s",
-                            name.c_str(),
-                            strerror(errno));
-                    log_ERROR(buffer);
-                    releaseMemory(buffer);
+                if (done) {
+                    skipped++;
                     continue;
                 }
-                if (S_ISREG(st.st_mode)) {
-                    //regular file.
-                    IMGs.push_back(
-                        std::make_tuple<>(stringDUP(name.c_str()), getNumber(name.c_str())));
-                } else if (S_ISDIR(st.st_mode)) {
-                    // directory
-                    AddDirectory(name.c_str());
-                } else {
-                    char* buffer = requestMemory(length + nameMax + 128);
-                    sprintf(buffer, "Unknown file type %s", name.c_str());
-                    log_ERROR(buffer);
-                    releaseMemory(buffer);
-                }
-            }
-        } while (true);
-        closedir(dir);
-        if (IMGs.size() % 3 != 0) {
-            char* buffer = requestMemory(length + 128);
-            sprintf(buffer, "Image Number in directory %s cannot be divided by 3 well.", parentPTR);
-            log_ERROR(buffer);
-            releaseMemory(buffer);
-        } else {
-            std::sort(IMGs.begin(), IMGs.end(), [&](auto& a, auto& b) {
-                return (std::get<NUMBER>(a) - std::get<NUMBER>(b)) <= 0;
-            });
-            for (vector<imgType>::size_type i = 0; i < IMGs.size();) {
-                auto p1 = IMGs[i];
-                i++;
-                auto p2 = IMGs[i];
-                i++;
-                auto p3 = IMGs[i];
-                i++;
-                auto it = new Item(std::get<FNAME>(p1), std::get<FNAME>(p2), std::get<FNAME>(p3));
-                if (it->getOK()) {
-                    ItemSchedular::getSchedular().addItem(it);
-                } else {
-                    delete it;
-                }
             }
+            auto it = new Item(files[i].c_str(), files[i + 1].c_str(), files[i + 2].c_str());
+            it->setJournalKey(keys);
+            itemSched.addItem(it);
         }
-        for (auto& ref : IMGs) {
-            releaseMemory(std::get<FNAME>(ref));
+        if (skipped > 0) {
+            char* buffer = requestMemory(parent.length() + 128);
+            sprintf(buffer, "Skip %d processed items in %s.", skipped, parent.c_str());
+            log_TRACE(buffer);
+            releaseMemory(buffer);
         }
     }
 
@@ -190,21 +260,137 @@ namespace fc
         delete instance;
     }
 
-    ItemSchedular::ItemSchedular() {}
+    ItemSchedular::ItemSchedular()
+        : maxItems(globalConfig.queueLength > 0 ? globalConfig.queueLength : 1),
+          decodeStat(tb::metrics::stage("decode")),
+          processStat(tb::metrics::stage("process")),
+          pixelsDecoded(0),
+          pixelsWritten(0),
+          executor(nullptr),
+          loop(nullptr),
+          http(nullptr),
+          graph(nullptr),
+          decoder(nullptr),
+          processor(nullptr),
+          writer(nullptr),
+          ocr(nullptr)
+    {
+        budget.setLimit(globalConfig.memoryBudget);
+    }
 
     ItemSchedular::~ItemSchedular()
     {
         delete ocr;
+        delete graph;
+        delete http;
+        delete loop;
+        delete executor;
     }
 
     int ItemSchedular::addItem(Item* i)
     {
-        queueMutex.lock();
-        items.emplace(i);
-        int size = items.size();
-        _cv.notify_all();
-        queueMutex.unlock();
-        return size;
+        // the walker is the only thread that waits for room, no stage ever blocks on the
+        // next one
+        graph->wait_below(maxItems);
+        if (budget.wait()) {
+            reportBudget();
+        }
+        decodeStat.enqueue();
+        decoder->post(i);
+        return graph->size();
+    }
+
+    void ItemSchedular::decode(Item* i)
+    {
+        decodeStat.dequeue();
+        auto begin = tb::metrics::now();
+        bool ok = i->decode();
+        decodeStat.observe(tb::metrics::now() - begin);
+        if (!ok) {
+            decodeStat.fail();
+            size_t bsize = 512;
+            char* buf = requestMemory(bsize);
+            snprintf(buf, bsize, "Decode triplet of %s failed. Skip.", i->getBoardName());
+            log_WARNING(buf);
+            releaseMemory(buf);
+            delete i;
+            return;
+        }
+        i->charge(budget);
+        processStat.enqueue();
+        processor->post(i);
+    }
+
+    void ItemSchedular::process(Item* i)
+    {
+        processStat.dequeue();
+        pixelsDecoded += i->pixels();
+        {
+            tb::metrics::ScopedTimer t(processStat);
+            i->processing();
+        }
+        pixelsWritten += i->pixels();
+        i->recharge();
+        ocr->addItem(i);
+    }
+
+    void ItemSchedular::reportBudget()
+    {
+        const size_t MiB = 1 << 20;
+        char buffer[256];
+        snprintf(buffer,
+                 256,
+                 "Decoded image budget: %lu MiB in use, peak %lu MiB of %lu MiB, producer waited "
+                 "%lu times, %ld items in the pipeline",
+                 budget.getUsed() / MiB,
+                 budget.getPeak() / MiB,
+                 budget.getLimit() / MiB,
+                 budget.getWaits(),
+                 graph->size());
+        log_INFO(buffer);
+    }
+
+    void ItemSchedular::reportOutput()
+    {
+        const double M = 1e6;
+        uint64_t in = pixelsDecoded.load();
+        uint64_t out = pixelsWritten.load();
+        if (in == 0) {
+            return;
+        }
+        char buffer[256];
+        snprintf(buffer,
+                 256,
+                 "Output images: %.1f Mpx decoded, %.1f Mpx watermarked and encoded, %.1f%% of "
+                 "the pixel work saved by shrinking first",
+                 in / M,
+                 out / M,
+                 100.0 * (in - std::min(in, out)) / in);
+        log_INFO(buffer);
+
+        auto& prior = BarCodePrior::getPrior();
+        if (prior.getMisses() > 0) {
+            snprintf(buffer,
+                     256,
+                     "Bar codes: %lu boards read in the learned window, %lu needed the detector",
+                     prior.getHits(),
+                     prior.getMisses());
+            log_INFO(buffer);
+        }
+
+        tb::matpool::Stats pool;
+        if (tb::matpool::stats(pool) && pool.hits + pool.misses > 0) {
+            snprintf(buffer,
+                     256,
+                     "Image buffers: %lu reused, %lu allocated, %lu over the pool cap, %lu MiB "
+                     "cached, %.1f%% hit rate",
+                     pool.hits,
+                     pool.misses,
+                     pool.dropped,
+                     pool.cached >> 20,
+                     100.0 * pool.hits / (pool.hits + pool.misses));
+            log_INFO(buffer);
+        }
     }
 
     void ItemSchedular::buildProcessor(int count)
@@ -213,77 +399,103 @@ namespace fc
             count = 1;
         }
         processCount = count;
+        if (globalConfig.imagePool > 0) {
+            // decode buffers and detector temporaries are the same few sizes over and over
+            tb::matpool::install(globalConfig.imagePool);
+        }
+        decodeCount = globalConfig.decoderThreadCount > 0 ? globalConfig.decoderThreadCount : 1;
+        int ocrCount = globalConfig.ocrConcurrency > 0 ? globalConfig.ocrConcurrency : 1;
+        long threads = globalConfig.executorThreads;
+        if (threads <= 0) {
+            // nothing on the executor waits for the network
+            long cores = sysconf(_SC_NPROCESSORS_ONLN);
+            threads = cores > 0 ? cores : 1;
+        }
+        executor = new tb::thread_ns::executor(threads);
+        loop = new tb::async::event_loop();
+        http = new tb::async::http_client(*loop);
+        loop->begin();
+        graph = new tb::thread_ns::task_graph(*executor);
+        decoder = &graph->add<Item*>(decodeCount, [this](Item*& i) { decode(i); });
+        processor = &graph->add<Item*>(processCount, [this](Item*& i) { process(i); });
+
+        queueItemNext dNext = [](recordPtr p) { p->report(true); };
+        if (globalConfig.writeProducts) {
+            // the disk only sees finished pictures, two writers keep it busy
+            writer = &graph->add<recordPtr>(2, [](recordPtr& p) { p->report(p->save()); });
+            auto w = writer;
+            dNext = [w](recordPtr p) { w->post(std::move(p)); };
+        }
         queueItemNext mNext = std::bind(&MySQLTimer::addItem, &sql, std::placeholders::_1);
         queueItemNext sNext =
 #ifdef BUILD_WITH_LIBSSH
             std::bind(&SFTP::addItem, &sftp, std::placeholders::_1);
+        sftp.attach(*graph, *loop);
 #else
-            [](std::shared_ptr<Item>) {};
+            [](recordPtr p) { p->report(true); };
 #endif
+        ocr = new OcrHandlerQueue(*graph, *executor, *http, dNext, mNext, sNext, ocrCount);
+
+        // decoded images wait for at most two rounds of processing, and processing only
+        // starts what the OCR stage can take
+        long decoded = 2 * processCount;
+        graph->throttle(*decoder, *processor, [decoded] { return decoded; });
+        auto o = ocr;
+        graph->throttle(*processor, ocr->getStage(), [o] { return o->window(); });
 
-        ocr = new OcrHandlerQueue(*this, mNext, sNext);
-        for (int i = 0; i < count; i++) {
-            processors.emplace_back(new ItemProcessor(*this, *ocr));
-        }
-        for (auto& p : processors) {
-            p->begin();
-        }
         ocr->begin();
         sql.begin();
-#ifdef BUILD_WITH_LIBSSH
-        sftp.begin();
-#endif
-    }
-
-    Item* ItemSchedular::getItem()
-    {
-        _cv.wait(queueMutex, [this] { return this->items.size() > 0; });
-        auto r = items.front();
-        items.pop();
-        queueMutex.unlock();
-        return r;
-    }
-    // ItemSchedular END
-    // ItemProcessor
-
-    ItemProcessor::ItemProcessor(ItemSchedular& _sched, OcrHandlerQueue& _ocr)
-        : thread("iprocess"), sched(_sched), ocr(_ocr)
-
-    {
-    }
-
-    void* ItemProcessor::start(void*, void*, void*)
-    {
-        do {
-            auto i = ItemSchedular::getSchedular().getItem();
-            if (i == nullptr) {
-                break;
-            }
-            i->processing();
-            usleep(rand() % 200000);
-            ocr.addItem(i);
-        } while (true);
-        return nullptr;
     }
 
     void ItemSchedular::stopSchedular()
     {
-        for (int i = 0; i < processCount; i++) {
-            ItemSchedular::getSchedular().addItem(nullptr);
-        }
-        for (auto& thr : processors) {
-            thr->join();
-            delete thr;
+        reportBudget();
+        auto begin = tb::thread_ns::monotonic_us();
+        auto deadline = begin + static_cast<uint64_t>(globalConfig.shutdownTimeout) * 1000;
+        // the walker is done, everything it handed in runs to completion or is given up
+        // on when the deadline passes
+        graph->wait_idle_until(deadline);
+        if (OcrLimiter::getLimiter().getState() == OcrLimiter::PAUSED) {
+            // waiting for tomorrow's quota would block the shutdown
+            OcrLimiter::getLimiter().stop();
         }
-        ocr->addItem(nullptr);
-        ocr->join();
-
-        sql.addItem(nullptr);
+        bool clean = ocr->close(deadline);
+        // encodes, writes and uploads posted by the last OCR results; SFTP has no transfer
+        // timeout, so they get the same deadline
+        long cut = graph->wait_idle_until(deadline) ? 0 : graph->size();
+        executor->stop();
+        loop->stop();
+        reportOutput();
+
+        // wakes the MySQL thread, the last batch is committed right away
+        sql.close();
         sql.join();
-#ifdef BUILD_WITH_LIBSSH
-        sftp.addItem(nullptr);
-        sftp.join();
-#endif
+
+        const size_t bsize = 256;
+        char buffer[bsize];
+        auto ms = (tb::thread_ns::monotonic_us() - begin) / 1000;
+        if (clean && cut == 0) {
+            snprintf(buffer, bsize, "Pipeline drained in %lu ms.", ms);
+            log_INFO(buffer);
+        } else if (!clean) {
+            snprintf(buffer,
+                     bsize,
+                     "Shutdown deadline of %d ms passed, pending OCR retries were dropped, "
+                     "drained in %lu ms.",
+                     globalConfig.shutdownTimeout,
+                     ms);
+            log_WARNING(buffer);
+        }
+        if (cut > 0) {
+            // never journaled, their raw files are kept for the next run
+            snprintf(buffer,
+                     bsize,
+                     "Shutdown deadline of %d ms passed, %ld items still being stored were cut "
+                     "off.",
+                     globalConfig.shutdownTimeout,
+                     cut);
+            log_WARNING(buffer);
+        }
     }
 
     ItemSchedular& ItemSchedular::getSchedular()
@@ -309,105 +521,214 @@ namespace fc
         price = this->price;
     }
 
-    void Item::getOcrJson(string& json)
-    {
-        json = string(ocr.dumpJson());
-    }
-
     Item::Item(const char* _p1, const char* _p2, const char* _p3)
         : PIC_1(stringDUP(_p1)),
           PIC_2(stringDUP(_p2)),
           PIC_3(stringDUP(_p3)),
-          front(PIC_1),
-          back(PIC_2),
-          board(PIC_3)
+          front(PIC_1, true),
+          back(PIC_2, true),
+          board(PIC_3, true)
     {
         ok = true;
         ocrfailed = 0;
         memset(roi, 0, sizeof(int) * 4);
-        if (front.getMat().empty() || back.getMat().empty() || board.getMat().empty()) {
-            ok = false;
+        zbarStatus = 0;
+        encodesLeft = 0;
+        encodeFailed = false;
+        memset(journalKey, 0, sizeof journalKey);
+        budget = nullptr;
+        charged = 0;
+        // only the board feeds barcode detection, the others are just shrunk to destWidth
+        if (globalConfig.reducedDecode && globalConfig.destWidth > 0) {
+            front.setDecodeWidth(globalConfig.destWidth);
+            back.setDecodeWidth(globalConfig.destWidth);
         }
     }
 
+    bool Item::decode()
+    {
+        bool f = front.load();
+        bool b = back.load();
+        bool o = board.load();
+        ok = f && b && o;
+        return ok;
+    }
+
     Item::~Item()
     {
+        if (budget != nullptr) {
+            budget->release(charged);
+        }
         releaseMemory(PIC_1);
         releaseMemory(PIC_2);
         releaseMemory(PIC_3);
     }
 
-    void Item::setDestPath(path& p1, path& p2, path& p3)
+    size_t Item::memorySize() const
     {
-        swap(destPIC[0], p1);
-        swap(destPIC[1], p2);
-        swap(destPIC[2], p3);
+        size_t ret = 0;
+        for (auto i : {&front, &back, &board}) {
+            auto& m = i->getMat();
+            ret += m.total() * m.elemSize();
+        }
+        return ret;
     }
 
-    void Item::SaveFile()
+    size_t Item::pixels() const
     {
-        if (!ok) {
-            return;
+        size_t ret = 0;
+        for (auto i : {&front, &back, &board}) {
+            ret += i->getMat().total();
         }
-        const static auto product = globalConfig.productPath;
-        const static bool del = globalConfig.deleteRaw;
-        const static auto raw = globalConfig.rawPath;
-        const static int jpgQuality = globalConfig.jpgQuality;
-        const static int width = globalConfig.destWidth;
-        vector<int> param;
-        param.push_back(cv::IMWRITE_JPEG_QUALITY);
-        param.push_back(jpgQuality);
+        return ret;
+    }
+
+    void Item::charge(MemoryBudget& b)
+    {
+        charged = memorySize();
+        budget = &b;
+        b.charge(charged);
+    }
+
+    void Item::recharge()
+    {
+        size_t now = memorySize();
+        if (budget != nullptr && now < charged) {
+            budget->release(charged - now);
+            charged = now;
+        }
+    }
+
+    std::shared_ptr<ItemRecord> Item::buildRecord()
+    {
+        auto r = std::make_shared<ItemRecord>();
 
         path parentDirectory = path(PIC_1).parent_path().filename();
 
         const string& code = this->bcode == "" ? "xxxx" : this->bcode;
 
-        path pic1 = parentDirectory
-                    / (parentDirectory.filename().native() + "_" + code + "_"
-                       + path(PIC_1).filename().native());
-        path pic2 = parentDirectory
-                    / (parentDirectory.filename().native() + "_" + code + "_"
-                       + path(PIC_2).filename().native());
-        path pic3 = parentDirectory
-                    / (parentDirectory.filename().native() + "_" + code + "_"
-                       + path(PIC_3).filename().native());
+        const char* raw[3] = {PIC_1, PIC_2, PIC_3};
+        for (int k = 0; k < 3; k++) {
+            r->dest[k] = parentDirectory
+                         / (parentDirectory.filename().native() + "_" + code + "_"
+                            + path(raw[k]).filename().native());
+            r->pictures[k] = std::move(encoded[k]);
+            r->raw[k] = raw[k];
+        }
 
-        path p1 = product / pic1;
-        path p2 = product / pic2;
-        path p3 = product / pic3;
+        // zbar read the board before anything touched it, OCR fills in what it missed
+        r->barcode = zbarCode;
+        if (r->barcode == "") {
+            ocr.getBarCode(r->barcode);
+        }
+        ocr.getFullCode(r->fullcode);
+        r->price = 0;
+        ocr.getPrice(r->price);
+        char* json = ocr.dumpJson();
+        if (json != nullptr) {
+            r->ocrJson = json;
+            releaseMemory(json);
+        }
+        memcpy(r->roi, roi, sizeof roi);
+        memcpy(r->journalKey, journalKey, sizeof journalKey);
+        return r;
+    }
+
+    bool ItemRecord::save() const
+    {
+        const static auto product = globalConfig.productPath;
 
         size_t bsize = 1024;
         char* buffer = tb::utils::requestMemory(bsize);
 
         int saved = 0;
-        auto parent = p1.parent_path();
+        auto parent = (product / dest[0]).parent_path();
         if (!exists(parent)) {
             create_directory(parent);
         }
-        front.resizeToWidth(width);
-        back.resizeToWidth(width);
-        board.resizeToWidth(width);
-
-        saved += front.WriteToFile(p1.c_str(), param);
-
-        saved += back.WriteToFile(p2.c_str(), param);
+        for (int k = 0; k < 3; k++) {
+            if (pictures[k] != nullptr && !pictures[k]->data.empty()) {
+                saved += writeBuffer((product / dest[k]).c_str(), pictures[k]->data);
+            }
+        }
 
-        saved += board.WriteToFile(p3.c_str(), param);
+        snprintf(buffer,
+                 bsize,
+                 "Saving %s -> %s, Status %d",
+                 raw[0].c_str(),
+                 (product / dest[0]).c_str(),
+                 saved);
+        log_DEBUG(buffer);
+        releaseMemory(buffer);
+        return saved == 3;
+    }
 
+    void ItemRecord::report(bool ok) const
+    {
+        const static bool del = globalConfig.deleteRaw;
+        if (!ok) {
+            failed = true;
+        }
+        if (--sinks != 0 || failed) {
+            return;
+        }
+        auto journal = ProcessedJournal::getJournal();
+        if (journal != nullptr && journalKey[0] != 0) {
+            journal->append(journalKey, 3);
+        }
         if (del) {
-            unlink(PIC_1);
-            unlink(PIC_2);
-            unlink(PIC_3);
+            for (auto& r : raw) {
+                unlink(r.c_str());
+            }
+        }
+    }
+
+    void Item::encode(tb::thread_ns::executor& ex, std::function<void()> then)
+    {
+        const static tb::jpeg::options options = globalConfig.jpeg;
+        Image* images[3] = {&front, &back, &board};
+        encodesLeft = 3;
+        for (int k = 0; k < 3; k++) {
+            if (encoded[k] == nullptr) {
+                encoded[k] = std::make_shared<EncodedPicture>();
+            }
+            ex.submit([this, images, k, then] {
+                auto& e = *encoded[k];
+                if (images[k]->encode(options, e.data)) {
+                    tb::utils::MD5Hash(
+                        reinterpret_cast<const char*>(e.data.data()), e.data.size(), e.md5);
+                } else {
+                    encodeFailed = true;
+                    size_t bsize = 512;
+                    char* buf = requestMemory(bsize);
+                    snprintf(buf,
+                             bsize,
+                             "Encoding picture %d of %s failed, not stored.",
+                             k + 1,
+                             PIC_3);
+                    log_WARNING(buf);
+                    releaseMemory(buf);
+                }
+                if (--encodesLeft == 0) {
+                    // everything downstream works on the encoded bytes
+                    for (auto i : images) {
+                        i->release();
+                    }
+                    recharge();
+                    then();
+                }
+            });
         }
-        snprintf(buffer, bsize, "Saving %s -> %s, Status %d", PIC_1, p1.c_str(), saved);
-        setDestPath(pic1, pic2, pic3);
-        log_DEBUG(buffer);
     }
 
     int Item::processingAccurateOCR(int& curl, bool accur)
     {
-        static char buffer[1024];
-        int ret = ProcessingOCR(PIC_3, ocr, curl, accur);
+        return setOcrOutcome(ProcessingOCR(PIC_3, ocr, curl, accur), accur);
+    }
+
+    int Item::setOcrOutcome(int ret, bool accur)
+    {
+        char buffer[1024];
         ocr.getBarCode(bcode);
         ocr.getFullCode(fcode);
         ocr.getPrice(price);
@@ -431,41 +752,104 @@ namespace fc
 
     int Item::processing()
     {
-        front.AddWaterPrint();
-        back.AddWaterPrint();
-        board.AddWaterPrint();
+        const static int width = globalConfig.destWidth;
+        // the barcode needs every pixel of the board and must not see the watermark
+        zbarStatus = BarCodePrior::getPrior().read(
+            board, path(PIC_1).parent_path().native(), zbarCode, roi);
+        // the watermark is placed on the output sized images, the blend, the encoder, the
+        // upload and the MD5 only see destWidth wide pictures
+        for (auto i : {&front, &back, &board}) {
+            if (width > 0 && i->getMat().cols > width) {
+                i->resizeToWidth(width);
+            }
+            i->AddWaterPrint();
+        }
         return 0;
     }
 
+    BarCodePrior::BarCodePrior() : hits(0), misses(0) {}
+
+    BarCodePrior& BarCodePrior::getPrior()
+    {
+        static BarCodePrior prior;
+        return prior;
+    }
+
+    int BarCodePrior::read(Image& board, const string& dir, string& code, int* roi)
+    {
+        std::array<int, 4> window;
+        _l.read();
+        auto iter = windows.find(dir);
+        bool known = iter != windows.end();
+        if (known) {
+            window = iter->second;
+        }
+        _l.unlock();
+
+        if (known) {
+            string c;
+            if (board.readBarCode(c, window.data()) == 1 && only::checkBarCodeValidate(c)) {
+                hits++;
+                code = c;
+                memcpy(roi, window.data(), sizeof(int) * 4);
+                return 1;
+            }
+        }
+        misses++;
+        int ret = board.getBarCode(code, roi, globalConfig.barcodeDetectWidth);
+        if (ret == 1 && only::checkBarCodeValidate(code)) {
+            _l.write();
+            memcpy(windows[dir].data(), roi, sizeof(int) * 4);
+            _l.unlock();
+        }
+        return ret;
+    }
+
     // item
 #ifdef BUILD_WITH_LIBSSH
-    void* SFTP::start(void*, void*, void*)
+    void SFTP::attach(tb::thread_ns::task_graph& g, tb::async::event_loop& l)
     {
-        static auto product = globalConfig.productPath;
-        do {
-            _cv.wait(_m, [this] { return _q.size() > 0; });
+        loop = &l;
+        sftp.attach(l);
+        node = &g.add_async<recordPtr>(
+            1, [this](recordPtr& p, ptrStage::completion done) { send(p, done); });
+    }
 
-            auto p = _q.front();
-            _q.pop();
-            _m.unlock();
+    void SFTP::send(recordPtr& p, ptrStage::completion done)
+    {
+        stat.dequeue();
+        loop->spawn(upload(p, std::move(done)));
+    }
 
-            if (p == nullptr) {
-                break;
+    tb::async::task<void> SFTP::upload(recordPtr p, ptrStage::completion done)
+    {
+        auto begin = tb::metrics::now();
+        bool ok = true;
+
+        // the coroutine frame holds the record, so the encoded bytes outlive the upload
+        for (int k = 0; k < 3; k++) {
+            auto& e = p->pictures[k];
+            if (e == nullptr || e->data.empty()) {
+                stat.fail();
+                ok = false;
+                continue;
             }
-            path pname[3];
-            p->getDestName(pname[0], pname[1], pname[2]);
-
-            for (auto& f : pname) {
-                sftp.sendFile((product / f).c_str(), f.c_str());
+            auto data = reinterpret_cast<const char*>(e->data.data());
+            if (co_await sftp.sendBufferAsync(data, e->data.size(), p->dest[k].native()) != 0) {
+                stat.fail();
+                ok = false;
             }
-        } while (true);
-        return nullptr;
+        }
+        stat.observe(tb::metrics::now() - begin);
+        p->report(ok);
+        done();
     }
 #endif
 
-    bool MySQLTimer::processing(std::queue<std::shared_ptr<Item>>& _q)
+    void MySQLTimer::processing(queueType& _q)
     {
-        bool ret = false;
+        // inserted rows only count once the transaction is committed
+        vector<recordPtr> inserted;
         instance.beginTransation();
         const size_t bsize = 1 << 14;
         static char* buffer = new char[bsize];
@@ -474,63 +858,57 @@ namespace fc
                 "INSERT INTO `Clothes` (`BarCode`, `FullCode`, `FrontPath`, `BackPath`, "
                 "`BoardPath`, `BoardPrice`, `OcrResult`, `DirectoryID`, `RoI`) VALUES ";
             int i = 0;
+            vector<recordPtr> rows;
             do {
                 auto p = _q.front();
                 _q.pop();
-                if (p == nullptr) {
-                    if (_q.size() == 0) {
-                        ret = true;
-                        break;
-                    } else {
-                        continue;
-                    }
-                }
-                path pic[3];
+                stat.dequeue();
+                auto pic = p->dest;
+                // hashed once when the pictures were encoded
                 string md5[3];
-                string barcode, fullcode;
-                int price;
-                string json;
-                const char* pic_raw_name[3];
-                p->getName(pic_raw_name[0], pic_raw_name[1], pic_raw_name[2]);
-                string fnmae(pic_raw_name[0]);
-
-                p->getDestName(pic[0], pic[1], pic[2]);
-                p->getOcrJson(json);
-                p->getCode(fullcode, barcode, price);
-                p->getBarCode(barcode);
                 for (int i = 0; i < 3; i++) {
-                    auto fn = globalConfig.productPath / pic[i];
-                    tb::utils::MD5HashFile(fn.c_str(), md5[i]);
+                    if (p->pictures[i] != nullptr) {
+                        md5[i] = p->pictures[i]->md5;
+                    }
                 }
                 path parent = pic[0].parent_path();
                 uint64_t did = globalConfig.getDirectoryID(parent.native());
-                auto roi = p->getRoI();
+                auto roi = p->roi;
                 snprintf(buffer,
                          bsize,
                          "('%s', '%s', '%s|%s', '%s|%s','%s|%s', %d, '%s', %ld, '%d:%d:%d:%d')",
-                         barcode.c_str(),
-                         fullcode.c_str(),
+                         p->barcode.c_str(),
+                         p->fullcode.c_str(),
                          pic[0].c_str(),
                          md5[0].c_str(),
                          pic[1].c_str(),
                          md5[1].c_str(),
                          pic[2].c_str(),
                          md5[2].c_str(),
-                         price,
-                         json.c_str(),
+                         p->price,
+                         p->ocrJson.c_str(),
                          did,
                          roi[0],
                          roi[1],
                          roi[2],
                          roi[3]);
                 sql = sql + buffer + ",";
+                rows.emplace_back(std::move(p));
                 i++;
                 this->processed++;
             } while (i < 10 && _q.size() > 0);
             if (i > 0) {
                 auto last = sql.find_last_of(',');
                 sql.at(last) = ';';
+                auto begin = tb::metrics::now();
                 auto ret = instance.query(sql.c_str());
+                // one observation per INSERT batch
+                stat.observe(tb::metrics::now() - begin);
+                if (ret != 0) {
+                    for (int k = 0; k < i; k++) {
+                        stat.fail();
+                    }
+                }
                 snprintf(buffer,
                          bsize,
                          "Inserting %d into mysql, total insert %d, mysql_query returns %d",
@@ -538,95 +916,329 @@ namespace fc
                          this->processed,
                          ret);
                 log_DEBUG(buffer);
+                if (ret == 0) {
+                    inserted.insert(inserted.end(), rows.begin(), rows.end());
+                } else {
+                    for (auto& r : rows) {
+                        r->report(false);
+                    }
+                }
             }
         }
-        instance.commit();
-        return ret;
+        bool committed = instance.commit() == 0;
+        if (!committed) {
+            snprintf(buffer, bsize, "MySQL commit failed: %s", instance.getErrorString());
+            log_ERROR(buffer);
+        }
+        for (auto& r : inserted) {
+            r->report(committed);
+        }
     }
 
-    OcrHandlerQueue::~OcrHandlerQueue() {}
+    // OcrRetryTimer
 
-    void OcrHandlerQueue::addItem(Item* i)
+    OcrRetryTimer::OcrRetryTimer(fireFn f, size_t cap)
+        : thread("ocrretry"),
+          fire(f),
+          origin(tb::metrics::now()),
+          maxPending(cap),
+          parked(0),
+          running(true),
+          draining(false)
+    {
+    }
+
+    uint64_t OcrRetryTimer::tick() const
+    {
+        return (tb::metrics::now() - origin) / (tickMs * 1000);
+    }
+
+    void OcrRetryTimer::schedule(Item* i, unsigned int ms)
     {
         _m.lock();
-        _q.emplace(i);
-        _cv.notify_all();
+        // the wheel may lag behind a little, keep the delay relative to the wall clock
+        auto lag = tick() - wheel.now();
+        wheel.schedule(i, lag + (ms + tickMs - 1) / tickMs);
+        parked.fetch_add(1, std::memory_order_relaxed);
         _m.unlock();
     }
 
-    void* OcrHandlerQueue::start(void*, void*, void*)
+    void OcrRetryTimer::drain()
     {
-        do {
-            _cv.wait(_m, [this] { return _q.size() > 0; });
-            auto i = _q.front();
-            _q.pop();
+        draining = true;
+    }
+
+    void OcrRetryTimer::stop()
+    {
+        running = false;
+    }
+
+    void* OcrRetryTimer::start(void*, void*, void*)
+    {
+        std::vector<Item*> due;
+        while (running) {
+            usleep(tickMs * 1000);
+            _m.lock();
+            auto collect = [&due](Item*& i) { due.push_back(i); };
+            wheel.advance(tick(), collect);
+            if (draining) {
+                wheel.flush(collect);
+            }
             _m.unlock();
-            if (i == nullptr) {
-                _m.lock();
-                auto s = _q.size();
-                _m.unlock();
-                if (s == 0) {
-                    return nullptr;
-                } else {
-                    addItem(nullptr);
-                    continue;
-                }
+            for (auto i : due) {
+                fire(i);
+                // counted until it is queued for OCR again, so the window never sees a gap
+                parked.fetch_sub(1, std::memory_order_relaxed);
             }
-            int f = i->getFailed();
-            int curl;
+            due.clear();
+        }
+        return nullptr;
+    }
 
-            string bc, fc, ocrBc, barCode;
-            i->getBarCode(barCode);
-            i->processingAccurateOCR(curl, f > 5);
+    // OcrRetryTimer END
+    // OcrHandlerQueue
 
-            int price;
-            i->getCode(fc, bc, price);
-            if (bc == "" && barCode != "") {
-                bc = barCode;
+    // One item per request slot keeps every slot busy; on top of that as many items may wait
+    // as the limiter lets through during one request, at most one more per slot.
+    void OcrHandlerQueue::resizeWindow(uint64_t us)
+    {
+        double s = serviceTime.load(std::memory_order_relaxed);
+        s = s == 0 ? us : s * 0.9 + us * 0.1;
+        serviceTime.store(s, std::memory_order_relaxed);
+        double ahead = std::ceil(OcrLimiter::getLimiter().getRate() * s / 1e6);
+        long n = concurrency;
+        admission.store(n + std::min(static_cast<long>(ahead), n), std::memory_order_relaxed);
+    }
+
+    void OcrHandlerQueue::addItem(Item* i)
+    {
+        outstanding++;
+        stat.enqueue();
+        node.post(i);
+    }
+
+    bool OcrHandlerQueue::waitSettled(uint64_t deadline)
+    {
+        do {
+            auto key = settled.prepare();
+            if (outstanding.load() == 0) {
+                settled.cancel();
+                return true;
             }
-            if (fc != "") {
-                i->SaveFile();
-                std::shared_ptr<Item> iptr;
-                iptr.reset(i);
-                mysql(iptr);
-                sftp(iptr);
-            } else if (f < 6) {
-                i->ocrFailed();
-                this->addItem(i);
-            } else {
-                if (bc != "") {
-                    i->SaveFile();
-                    std::shared_ptr<Item> iptr;
-                    iptr.reset(i);
-                    mysql(iptr);
-                    sftp(iptr);
-                } else {
-                    size_t bsize = 512;
-                    char* buf = requestMemory(bsize);
-                    snprintf(buf,
-                             bsize,
-                             "Get Ocr Result of file %s failed 5 times. Skip this file.",
-                             i->getBoardName());
-                    log_WARNING(buf);
-                    releaseMemory(buf);
-                    delete i;
-                }
+            if (deadline == 0) {
+                settled.wait(key);
+                continue;
+            }
+            auto t = tb::thread_ns::monotonic_us();
+            if (t >= deadline) {
+                settled.cancel();
+                return false;
             }
+            settled.wait_for(key, deadline - t);
         } while (true);
     }
 
-    OcrHandlerQueue::OcrHandlerQueue(ItemSchedular& _sched,
+    bool OcrHandlerQueue::close(uint64_t deadline)
+    {
+        // retries come back through the OCR stage, wait until every item is settled
+        retries.drain();
+        bool clean = waitSettled(deadline);
+        if (!clean) {
+            // the service is down or out of quota: failed requests are dropped from now on
+            // and requests still waiting for a token fail at once, so only the ones on the
+            // wire are left, bounded by the request timeout
+            abandoning = true;
+            OcrLimiter::getLimiter().stop();
+            waitSettled(0);
+        }
+        retries.stop();
+        retries.join();
+        return clean;
+    }
+
+    void OcrHandlerQueue::begin()
+    {
+        retries.begin();
+    }
+
+    void OcrHandlerQueue::run(Item* i, ItemStage::completion done)
+    {
+        stat.dequeue();
+        bool accurate = i->getFailed() > 5;
+        string body;
+        if (!OcrClient::buildRequest(i->getBoardName(), body)) {
+            handle(i, i->setOcrOutcome(-1, accurate));
+            done();
+            return;
+        }
+        loop.spawn(request(i, std::move(body), accurate, std::move(done)));
+    }
+
+    tb::async::task<void> OcrHandlerQueue::request(Item* i,
+                                                   string body,
+                                                   bool accurate,
+                                                   ItemStage::completion done)
+    {
+        int curl;
+        auto begin = tb::metrics::now();
+        int ret = co_await client.recognize(std::move(body), i->getOcrResult(), curl, accurate);
+        auto us = tb::metrics::now() - begin;
+        stat.observe(us);
+        resizeWindow(us);
+        // saving and the next stages are CPU work, off the loop thread
+        executor.submit([this, i, ret, accurate, done] {
+            handle(i, i->setOcrOutcome(ret, accurate));
+            done();
+        });
+    }
+
+    void OcrHandlerQueue::retry(Item* i, unsigned int attempt)
+    {
+        if (abandoning) {
+            finish(i, false);
+            return;
+        }
+        const static unsigned int base = globalConfig.ocrRetryBase;
+        const static unsigned int max = globalConfig.ocrRetryMax;
+        const static double jitter = globalConfig.ocrRetryJitter;
+        double delay = base;
+        for (unsigned int k = 1; k < attempt && delay < max; k++) {
+            delay *= 2;
+        }
+        delay = std::min(delay, static_cast<double>(max));
+        // spread retries of a bad batch so they do not come back in one burst
+        delay *= 1 + jitter * (2.0 * rand() / RAND_MAX - 1);
+        // past maxPending the window is closed, only requests already admitted still come
+        // in here, so the wheel overshoots the cap by at most one window
+        retries.schedule(i, delay < 0 ? 0 : static_cast<unsigned int>(delay));
+    }
+
+    void OcrHandlerQueue::finish(Item* i, bool ok)
+    {
+        if (ok) {
+            // the item stays outstanding until its pictures are encoded and stored
+            i->encode(executor, [this, i] { store(i); });
+            return;
+        }
+        stat.fail();
+        delete i;
+        settle();
+    }
+
+    void OcrHandlerQueue::store(Item* i)
+    {
+        if (!i->getEncoded()) {
+            // an empty picture would be saved, hashed and journaled as if it were fine
+            finish(i, false);
+            return;
+        }
+        recordPtr r = i->buildRecord();
+        delete i;
+        disk(r);
+        mysql(r);
+        sftp(r);
+        settle();
+    }
+
+    void OcrHandlerQueue::settle()
+    {
+        if (--outstanding == 0) {
+            settled.notify_all();
+        }
+    }
+
+    void OcrHandlerQueue::handle(Item* i, int ret)
+    {
+        int f = i->getFailed();
+
+        string bc, fc, ocrBc, barCode;
+        i->getBarCode(barCode);
+        if (ret == OCR_THROTTLED) {
+            // the limiter already slowed down, the attempt does not count
+            retry(i, 1);
+            return;
+        }
+
+        int price;
+        i->getCode(fc, bc, price);
+        if (bc == "" && barCode != "") {
+            bc = barCode;
+        }
+        if (fc != "") {
+            finish(i, true);
+        } else if (f < 6) {
+            i->ocrFailed();
+            retry(i, i->getFailed());
+        } else {
+            if (bc != "") {
+                finish(i, true);
+            } else {
+                size_t bsize = 512;
+                char* buf = requestMemory(bsize);
+                snprintf(buf,
+                         bsize,
+                         "Get Ocr Result of file %s failed 5 times. Skip this file.",
+                         i->getBoardName());
+                log_WARNING(buf);
+                releaseMemory(buf);
+                finish(i, false);
+            }
+        }
+    }
+
+    OcrHandlerQueue::OcrHandlerQueue(tb::thread_ns::task_graph& graph,
+                                     tb::thread_ns::executor& _executor,
+                                     tb::async::http_client& http,
+                                     queueItemNext disknext,
                                      queueItemNext sqlnext,
-                                     queueItemNext sshnext)
-        : thread("ocr"), sched(_sched), mysql(sqlnext), sftp(sshnext)
+                                     queueItemNext sshnext,
+                                     int _concurrency)
+        : executor(_executor),
+          loop(http.getLoop()),
+          client(http),
+          disk(disknext),
+          mysql(sqlnext),
+          sftp(sshnext),
+          stat(tb::metrics::stage("ocr")),
+          concurrency(_concurrency > 0 ? _concurrency : 1),
+          node(graph.add_async<Item*>(concurrency,
+                                      [this](Item*& i, ItemStage::completion done) {
+                                          run(i, std::move(done));
+                                      })),
+          retries(
+              [this](Item* i) {
+                  stat.enqueue();
+                  node.post(i);
+              },
+              globalConfig.ocrRetryMaxPending),
+          outstanding(0),
+          abandoning(false),
+          admission(2 * concurrency),
+          serviceTime(0)
     {
     }
 
+    // OcrHandlerQueue END
 
     void Start(FcHandler& handler)
     {
         char buffer[256];
         getcwd(buffer, 256);
+#ifdef USE_INOTIFY
+        if (globalConfig.watch) {
+            if (globalConfig.useInotify && globalConfig.inotifyFD >= 0) {
+                DirectoryWatcher watcher(
+                    globalConfig.inotifyFD,
+                    globalConfig.watchDebounce,
+                    [&handler](const string& dir, vector<string>& files) {
+                        handler.AddFiles(dir, files);
+                    });
+                watcher.watch(buffer);
+                return;
+            }
+            log_WARNING("Watch mode requires useInotify, fall back to a single scan.");
+        }
+#endif
         handler.AddDirectory(buffer);
     }
 }  // namespace fc
@@ -647,10 +1259,13 @@ int main(int argc, char* argv[])
     sc.stopSchedular();
 
     fc::ImageProcessingDestroy();
+    fc::OcrLimiter::destroyLimiter();
     tb::remote::MySQLWorker::destroyMySQLInstance();
 #ifdef BUILD_WITH_LIBSSH
     tb::remote::SFTPWorker::destrypSFTPInstance();
 #endif
     fc::ItemSchedular::destroyItemSchedular();
+    fc::ProcessedJournal::destroyJournal();
+    tb::metrics::Registry::destroyRegistry();
     tb::Logger::DestoryLogger();
 }
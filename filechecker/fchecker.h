@@ -4,6 +4,7 @@
 #define FCHECKER_H
 
 #include "image.h"
+#include "metrics.h"
 #include "remote.h"
 #include "taobao.h"
 #include "threads.h"
@@ -13,13 +14,20 @@
 #endif
 
 #include <dirent.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <json/json.h>
+#include <array>
+#include <atomic>
 #include <cstring>
+#include <deque>
+#include <map>
 #include <memory>
 #include <queue>
+#include <set>
 #include <string>
+#include <unordered_set>
 
 #include <cstdint>
 
@@ -31,6 +39,10 @@ using std::string;
 
 void* fcheckerHandler(void*);
 
+#ifdef USE_INOTIFY
+struct inotify_event;
+#endif
+
 using std::string;
 using tb::utils::releaseMemory;
 using tb::utils::requestMemory;
@@ -46,10 +58,32 @@ public:
     path productPath;
     bool chRoot;
     bool useInotify;
+    bool watch;
+    int watchDebounce;
     bool deleteRaw;
+    // write the product pictures below productDirectory, MySQL and SFTP do not need them
+    bool writeProducts;
+    string journalPath;
+    string metricsPath;
+    int metricsInterval;
     int uid, gid;
     bool forkToBackground;
     int threadCount;
+    int ocrConcurrency;
+    int ocrRetryBase;
+    int ocrRetryMax;
+    double ocrRetryJitter;
+    int ocrRetryMaxPending;
+    int walkerThreadCount;
+    int decoderThreadCount;
+    // 0 picks one thread per core
+    int executorThreads;
+    // milliseconds the shutdown waits on OCR and uploads before it drops what is left
+    int shutdownTimeout;
+    int queueLength;
+    size_t memoryBudget;
+    // bytes of freed image buffers kept for reuse, 0 leaves OpenCV's allocator alone
+    size_t imagePool;
     int productPrefixLength;
 
     bool mysqlEnable;
@@ -73,6 +107,11 @@ public:
 
     int destWidth;
     int jpgQuality;
+    // jpgQuality, image.jpeg.subsampling, optimize and progressive
+    tb::jpeg::options jpeg;
+    bool reducedDecode;
+    // bar code search width, 0 for full resolution
+    int barcodeDetectWidth;
 
     std::map<string, uint64_t> dirs;
 
@@ -84,14 +123,16 @@ public:
     SystemConfig()
     {
 #ifdef USE_INOTIFY
-        inotifyFD = 0;
+        inotifyFD = -1;
 #endif
     }
 
     ~SystemConfig()
     {
 #ifdef USE_INOTIFY
-        close(inotifyFD);
+        if (inotifyFD >= 0) {
+            close(inotifyFD);
+        }
 #endif
     }
 
@@ -148,14 +189,136 @@ namespace fc
     using tb::thread_ns::mutex;
     using tb::thread_ns::thread;
 
+    // Append-only on-disk set of raw files whose rows already reached MySQL. A key is the
+    // FNV-1a hash of (path, size, mtime); the file is a magic header followed by 8 byte
+    // keys, mapped once at startup to build the in-memory index.
+    class ProcessedJournal
+    {
+        static ProcessedJournal* instance;
+
+        int fd;
+        size_t loaded;
+        std::unordered_set<uint64_t> keys;
+        mutable tb::thread_ns::rwlock _l;
+
+        ProcessedJournal(int);
+        ~ProcessedJournal();
+
+        int load(const char*, char*, size_t);
+
+    public:
+        static uint64_t buildKey(const char*, const struct stat&);
+        static int buildKey(const char*, uint64_t&);
+
+        bool contains(uint64_t) const;
+        int append(const uint64_t*, size_t);
+
+        size_t size() const;
+
+        static ProcessedJournal* initJournal(const char*);
+        static ProcessedJournal* getJournal();
+        static void destroyJournal();
+    };
+
+    // Byte budget shared by every decoded Item in flight. Decoded items are charged without
+    // waiting, only the walker blocks in wait() before it hands in another triplet, so the
+    // budget can be overshot by what is already being decoded but never deadlocks a stage.
+    class MemoryBudget
+    {
+        mutex _m;
+        condition_variable _cv;
+
+        size_t limit;
+        size_t used;
+        size_t peak;
+        size_t waits;
+
+    public:
+        MemoryBudget(size_t = 0);
+
+        void setLimit(size_t);
+        // blocks while the budget is exhausted, true if it had to wait
+        bool wait();
+        void charge(size_t);
+        void release(size_t);
+
+        size_t getUsed();
+        size_t getPeak();
+        size_t getLimit();
+        size_t getWaits();
+    };
+
+    // Where the bar code was last read, per raw directory. Every directory comes off one
+    // fixed rig, so the next board is scanned in that window first and the contour search
+    // only runs when it misses; a window found by the search replaces the old one.
+    class BarCodePrior
+    {
+        mutable tb::thread_ns::rwlock _l;
+        std::map<string, std::array<int, 4>> windows;
+        std::atomic<uint64_t> hits;
+        std::atomic<uint64_t> misses;
+
+        BarCodePrior();
+
+    public:
+        static BarCodePrior& getPrior();
+
+        // zbar status as Image::getBarCode() returns it, `roi` is where the code was found
+        int read(Image& board, const string& dir, string& code, int* roi);
+        uint64_t getHits() const
+        {
+            return hits.load();
+        }
+        uint64_t getMisses() const
+        {
+            return misses.load();
+        }
+    };
+
+    // one encoded product picture and its MD5, shared read-only by the disk writer, MySQL
+    // and SFTP
+    struct EncodedPicture {
+        std::vector<uint8_t> data;
+        string md5;
+    };
+
+    // Everything the sinks need of a finished item, a few hundred bytes plus the shared
+    // encoded pictures. The Item with its decoded images is gone once this exists.
+    struct ItemRecord {
+        // the source pictures, deleted with deleteRaw once every sink has them
+        string raw[3];
+        // relative to productDirectory and to the remote path
+        path dest[3];
+        std::shared_ptr<const EncodedPicture> pictures[3];
+        string barcode;
+        string fullcode;
+        int price;
+        // gzip + base64 of the OCR response
+        string ocrJson;
+        int roi[4];
+        uint64_t journalKey[3];
+
+        // disk, MySQL and SFTP each report once, disabled ones right away
+        static const int sinkCount = 3;
+        mutable std::atomic<int> sinks;
+        mutable std::atomic<bool> failed;
+
+        ItemRecord() : sinks(sinkCount), failed(false) {}
+        // writes the encoded pictures below productDirectory, false if one is missing
+        bool save() const;
+        // once every sink reported success the raw files go to the journal, and are
+        // deleted with deleteRaw
+        void report(bool) const;
+    };
+
+    using recordPtr = std::shared_ptr<const ItemRecord>;
+
     class Item
     {
         const char* PIC_1;
         const char* PIC_2;
         const char* PIC_3;
 
-        path destPIC[3];
-
         bool ok;
         Image front;
         Image back;
@@ -169,6 +332,19 @@ namespace fc
         int ocrfailed;
 
         int roi[4];
+        // zbar on the full resolution board, taken before it is shrunk and watermarked
+        string zbarCode;
+        int zbarStatus;
+
+        uint64_t journalKey[3];
+
+        // front, back and board as JPEG, filled by encode()
+        std::shared_ptr<EncodedPicture> encoded[3];
+        std::atomic<int> encodesLeft;
+        std::atomic<bool> encodeFailed;
+
+        MemoryBudget* budget;
+        size_t charged;
 
     public:
         bool getOK() const
@@ -186,33 +362,30 @@ namespace fc
 
         int processingAccurateOCR(int&, bool = false);
         int processingOCR(int&);
+        // takes the outcome of an OCR request for the board picture
+        int setOcrOutcome(int, bool);
 
         int getBarCode(string& c)
         {
-            auto ret = board.getBarCode(c, roi);
+            c = zbarCode;
             this->bcode = c;
-            return ret;
+            return zbarStatus;
         }
 
         void getCode(string&, string&, int&);
 
-        void getOcrJson(string&);
-
         const OcrResult& getOcrResult() const
         {
             return ocr;
         }
-
-        const char* getBoardName() const
+        OcrResult& getOcrResult()
         {
-            return PIC_3;
+            return ocr;
         }
 
-        void getDestName(path& p1, path& p2, path& p3)
+        const char* getBoardName() const
         {
-            p1 = destPIC[0];
-            p2 = destPIC[1];
-            p3 = destPIC[2];
+            return PIC_3;
         }
 
         void getName(const char*& p1, const char*& p2, const char*& p3)
@@ -222,40 +395,69 @@ namespace fc
             p3 = PIC_3;
         }
         int processing();
-        void SaveFile();
+        // encodes and hashes the three pictures on the executor, the last one to finish
+        // drops the decoded images and calls `then`
+        void encode(tb::thread_ns::executor&, std::function<void()> then);
+        // false if a picture could not be encoded, the item must not reach the sinks then
+        bool getEncoded() const
+        {
+            return !encodeFailed;
+        }
+        // names the product pictures and moves the results out, the item is done then
+        std::shared_ptr<ItemRecord> buildRecord();
 
         Item(const char*, const char*, const char*);
 
-        void setDestPath(path&, path&, path&);
-
         const int* getRoI() const
         {
             return roi;
         }
+
+        void setJournalKey(const uint64_t* k)
+        {
+            memcpy(journalKey, k, sizeof journalKey);
+        }
+
+        const uint64_t* getJournalKey() const
+        {
+            return journalKey;
+        }
+
+        size_t memorySize() const;
+        size_t pixels() const;
+        void charge(MemoryBudget&);
+        // gives back what shrinking the images freed
+        void recharge();
+        bool decode();
         ~Item();
     };
 
-    using queueItemNext = std::function<void(std::shared_ptr<Item>)>;
+    using queueItemNext = std::function<void(recordPtr)>;
 
+    // the sinks are drained in batches, so they get more room than the pipeline queues
+    const size_t remoteQueueLength = 4096;
+
+    // Hands the queued items to processing() every _int seconds. close() wakes the thread
+    // at once, so the last batch is flushed as soon as the pipeline ran dry.
     class ItemRemoteTimer : public thread
     {
-        using fn = std::function<bool(Item*)>;
-
-        using qsi = std::queue<std::shared_ptr<Item>>;
-
         virtual void* start(void*, void*, void*) override
         {
-            static qsi qu;
             do {
-                sleep(_int);
-                _m.lock();
-                std::swap(qu, _q);
-                while (_q.size() > 0) {
-                    _q.pop();
+                auto key = wake.prepare();
+                if (_q.closed()) {
+                    wake.cancel();
+                } else {
+                    wake.wait_for(key, static_cast<uint64_t>(_int) * 1000000);
+                }
+                // everything pushed before close() is drained below
+                bool closed = _q.closed();
+                recordPtr p;
+                while (_q.try_pop(p)) {
+                    batch.emplace(std::move(p));
                 }
-                _m.unlock();
-                auto r = processing(qu);
-                if (r && _q.size() == 0) {
+                processing(batch);
+                if (closed) {
                     break;
                 }
             } while (true);
@@ -264,21 +466,31 @@ namespace fc
 
 
         unsigned int _int;
+        tb::thread_ns::event_count wake;
 
     protected:
-        std::queue<std::shared_ptr<Item>> _q;
-        mutex _m;
-
-        using queueType = decltype(_q);
-        virtual bool processing(queueType&) = 0;
-        ItemRemoteTimer(int _i, const char* n) : thread(n), _int(_i) {}
+        tb::thread_ns::mpmc_queue<recordPtr> _q;
+        tb::metrics::Stage& stat;
+
+        using queueType = std::queue<recordPtr>;
+        // items processing() left behind are offered again with the next batch
+        queueType batch;
+        virtual void processing(queueType&) = 0;
+        ItemRemoteTimer(int _i, const char* n)
+            : thread(n), _int(_i), _q(remoteQueueLength), stat(tb::metrics::stage(n))
+        {
+        }
 
     public:
-        void addItem(std::shared_ptr<Item> _i)
+        void addItem(recordPtr _i)
         {
-            _m.lock();
-            _q.emplace(_i);
-            _m.unlock();
+            stat.enqueue();
+            _q.push(std::move(_i));
+        }
+        void close()
+        {
+            _q.close();
+            wake.notify_all();
         }
     };
 
@@ -287,7 +499,7 @@ namespace fc
         using sql = tb::remote::MySQLWorker;
 
         sql& instance;
-        virtual bool processing(queueType&) override;
+        virtual void processing(queueType&) override;
         int processed;
     public:
         MySQLTimer()
@@ -307,45 +519,67 @@ namespace fc
     using tb::thread_ns::condition_variable;
     using tb::thread_ns::mutex;
 
-    class ItemSchedular;
-    class ItemProcessor;
+    using ItemStage = tb::thread_ns::stage<Item*>;
+
 #ifdef BUILD_WITH_LIBSSH
-    class SFTP : public thread
+    // uploads one item at a time on the event loop, the SSH session is not shared between
+    // requests
+    class SFTP
     {
-        std::queue<std::shared_ptr<Item>> _q;
-        using queueType = decltype(_q);
-
-        mutex _m;
-        condition_variable _cv;
+        using ptrStage = tb::thread_ns::stage<recordPtr>;
 
         tb::remote::SFTPWorker& sftp;
-        virtual void* start(void*, void*, void*);
+        tb::metrics::Stage& stat;
+        ptrStage* node;
+        tb::async::event_loop* loop;
+
+        void send(recordPtr&, ptrStage::completion);
+        tb::async::task<void> upload(recordPtr, ptrStage::completion);
 
     public:
-        SFTP() : thread("sftp"), sftp(tb::remote::SFTPWorker::getSFTPInstance()) {}
+        SFTP()
+            : sftp(tb::remote::SFTPWorker::getSFTPInstance()),
+              stat(tb::metrics::stage("sftp")),
+              node(nullptr),
+              loop(nullptr)
+        {
+        }
 
-        void addItem(std::shared_ptr<Item> _i)
+        void attach(tb::thread_ns::task_graph&, tb::async::event_loop&);
+        void addItem(recordPtr _i)
         {
-            _m.lock();
-            _q.emplace(_i);
-            _cv.notify_all();
-            _m.unlock();
+            stat.enqueue();
+            node->post(std::move(_i));
         }
     };
 #endif
 
-    class ItemSchedular;
     class OcrHandlerQueue;
-    class ItemProcessor;
 
+    // walker -> decode -> process -> OcrHandlerQueue -> sftp, all stages of one task_graph
+    // sharing an executor. OCR and SFTP requests are coroutines on the event loop, MySQL
+    // keeps its batching timer thread.
     class ItemSchedular
     {
-        std::queue<Item*> items;
-        mutex queueMutex;
-        bool work;
-        condition_variable _cv;
+        long maxItems;
+        MemoryBudget budget;
+
+        tb::metrics::Stage& decodeStat;
+        tb::metrics::Stage& processStat;
+        // pixels of the decoded images and of the shrunk ones that are watermarked and saved
+        std::atomic<uint64_t> pixelsDecoded;
+        std::atomic<uint64_t> pixelsWritten;
+
         int processCount;
-        std::vector<ItemProcessor*> processors;
+        int decodeCount;
+        tb::thread_ns::executor* executor;
+        tb::async::event_loop* loop;
+        tb::async::http_client* http;
+        tb::thread_ns::task_graph* graph;
+        ItemStage* decoder;
+        ItemStage* processor;
+        // nullptr unless system.writeProducts
+        tb::thread_ns::stage<recordPtr>* writer;
         OcrHandlerQueue* ocr;
 
         MySQLTimer sql;
@@ -362,39 +596,209 @@ namespace fc
         static void destroyItemSchedular();
         void buildProcessor(int = 1);
         void stopSchedular();
+        // blocks the caller while the pipeline is full or the memory budget is exhausted
         int addItem(Item*);
-        Item* getItem();
+        void decode(Item*);
+        void process(Item*);
+        void reportBudget();
+        void reportOutput();
     };
 
 
-    class OcrHandlerQueue : public tb::thread_ns::thread
+    // Parks failed OCR items on a timer wheel until their backoff expires, then hands them to
+    // the callback. Once image.ocr.retry.maxPending items are parked, new items are held back
+    // in front of OCR until retries come back; nothing is dropped for the cap.
+    class OcrRetryTimer : public tb::thread_ns::thread
+    {
+        using fireFn = std::function<void(Item*)>;
+
+        static const unsigned int tickMs = 10;
+
+        mutex _m;
+        tb::thread_ns::timer_wheel<Item*> wheel;
+        fireFn fire;
+        uint64_t origin;
+        size_t maxPending;
+        std::atomic<size_t> parked;
+        std::atomic<bool> running;
+        std::atomic<bool> draining;
+
+        uint64_t tick() const;
+        virtual void* start(void*, void*, void*) override;
+
+    public:
+        OcrRetryTimer(fireFn, size_t);
+        virtual ~OcrRetryTimer() {}
+        void schedule(Item*, unsigned int);
+        size_t pending() const
+        {
+            return parked.load(std::memory_order_relaxed);
+        }
+        // true while maxPending items are parked; the OCR window closes then, so intake
+        // waits for the retries instead of dropping them
+        bool full() const
+        {
+            return maxPending != 0 && pending() >= maxPending;
+        }
+        // from now on every parked item is handed out at the next tick
+        void drain();
+        void stop();
+    };
+
+    // Keeps image.ocr.concurrency requests in flight: the image is encoded on the executor,
+    // the request is a coroutine on the event loop and its result is handled on the executor
+    // again, so items complete out of order.
+    class OcrHandlerQueue
     {
-        ItemSchedular& sched;
+        tb::thread_ns::executor& executor;
+        tb::async::event_loop& loop;
+        OcrClient client;
+        queueItemNext disk;
         queueItemNext mysql;
         queueItemNext sftp;
-        std::queue<Item*> _q;
-        mutex _m;
-        condition_variable _cv;
+        tb::metrics::Stage& stat;
+        long concurrency;
+        ItemStage& node;
+        OcrRetryTimer retries;
+        // items accepted by addItem that are neither finished nor dropped yet
+        std::atomic<long> outstanding;
+        tb::thread_ns::event_count settled;
+        // set once the shutdown deadline passed, retries are dropped instead of parked
+        std::atomic<bool> abandoning;
+        // how many items the stages feeding OCR may hold in front of it
+        std::atomic<long> admission;
+        // smoothed service time of one request in microseconds
+        std::atomic<double> serviceTime;
+
+        void run(Item*, ItemStage::completion);
+        tb::async::task<void> request(Item*, string, bool, ItemStage::completion);
+        void resizeWindow(uint64_t);
+        void handle(Item*, int);
+        void retry(Item*, unsigned int);
+        void finish(Item*, bool);
+        void store(Item*);
+        void settle();
+        bool waitSettled(uint64_t);
 
     public:
-        OcrHandlerQueue(ItemSchedular&, queueItemNext, queueItemNext);
-        virtual ~OcrHandlerQueue();
-        virtual void* start(void* = nullptr, void* = nullptr, void* = nullptr) override;
+        OcrHandlerQueue(tb::thread_ns::task_graph&,
+                        tb::thread_ns::executor&,
+                        tb::async::http_client&,
+                        queueItemNext,
+                        queueItemNext,
+                        queueItemNext,
+                        int);
+        void begin();
+        tb::thread_ns::graph_stage& getStage()
+        {
+            return node;
+        }
+        long window() const
+        {
+            return retries.full() ? 0 : admission.load(std::memory_order_relaxed);
+        }
         void addItem(Item*);
+        // waits for every accepted item, parked retries included. Items still retrying at
+        // `deadline` (tb::thread_ns::monotonic_us(), 0 for none) are dropped, false then.
+        bool close(uint64_t deadline = 0);
     };
 
-    class ItemProcessor : public tb::thread_ns::thread
+    // Scans a directory tree with a pool of work-stealing threads. Directories are opened
+    // with openat(2) relative to the root descriptor and dirent::d_type is trusted when the
+    // filesystem fills it in, so stat(2) is only issued for DT_UNKNOWN/DT_LNK entries. Every
+    // scanned directory hands its regular files to the callback right away.
+    class DirectoryWalker
     {
-        ItemSchedular& sched;
-        queueItemNext mysqlNext;
-        OcrHandlerQueue& ocr;
+    public:
+        using directoryCallback = std::function<void(const string&, std::vector<string>&)>;
+
+    private:
+        class Worker : public thread
+        {
+            friend class DirectoryWalker;
+
+            DirectoryWalker& walker;
+            size_t index;
+
+            mutex _m;
+            std::deque<string> _q;
+
+            virtual void* start(void*, void*, void*) override;
+
+        public:
+            Worker(DirectoryWalker&, size_t);
+            virtual ~Worker() {}
+        };
+
+        directoryCallback callback;
+        std::vector<Worker*> workers;
+
+        int rootFD;
+        string rootPath;
+
+        // directories sitting in some deque
+        std::atomic<long> queued;
+        // directories discovered but not finished yet (queued + being scanned)
+        std::atomic<long> pending;
+
+        mutex idleMutex;
+        condition_variable idleCV;
+
+        void push(size_t, string&&);
+        bool pop(size_t, string&);
+        bool steal(size_t, string&);
+        void scan(size_t, const string&);
+        void run(size_t);
 
     public:
-        virtual ~ItemProcessor(){};
-        ItemProcessor(ItemSchedular&, OcrHandlerQueue&);
-        virtual void* start(void* = nullptr, void* = nullptr, void* = nullptr) override;
+        DirectoryWalker(int, directoryCallback);
+        ~DirectoryWalker();
+
+        int walk(const char*);
     };
 
+#ifdef USE_INOTIFY
+    // Daemon mode: keeps recursive inotify watches on the raw tree and hands a directory's
+    // files to the callback once it has been quiet for the debounce period and holds whole
+    // triplets. Runs on the calling thread until SIGINT/SIGTERM or stop().
+    class DirectoryWatcher
+    {
+        struct Directory {
+            string path;
+            // file names written or moved in, not handed out yet
+            std::set<string> pending;
+            // handed out but not in the journal yet, left empty without a journal
+            std::set<string> emitted;
+            // CLOCK_MONOTONIC in ms, 0 when nothing is pending
+            uint64_t deadline;
+        };
+
+        int fd;
+        uint64_t debounce;
+        DirectoryWalker::directoryCallback callback;
+
+        std::map<int, Directory> dirs;
+        std::map<string, int> wds;
+
+        static int stopPipe[2];
+        static void signalHandler(int);
+
+        void addWatch(const string&, uint64_t);
+        void removeWatch(int);
+        void handleEvent(const struct inotify_event*, uint64_t);
+        bool addPending(Directory&, const char*);
+        void prune(Directory&);
+        int flush(uint64_t);
+
+    public:
+        DirectoryWatcher(int, int, DirectoryWalker::directoryCallback);
+        ~DirectoryWatcher();
+
+        int watch(const char*);
+        static void stop();
+    };
+#endif
+
     class FcHandler
     {
         friend void* fcheckerHandler(void*);
@@ -405,15 +809,22 @@ namespace fc
         mutex queueMutex;
 
         ItemSchedular& itemSched;
+        DirectoryWalker walker;
 
         FcHandler(const SystemConfig&);
         void setProductPath(const char*);
 
     public:
         static FcHandler& getHandler();
+        // number in a raw file name, -1 if it does not parse
+        static int getNumber(const char*);
+        // sorts `files` by number and keeps runs of three consecutive numbers, one triplet
+        // after the other; the files that fit into none are moved to `rest`. The walker and
+        // the watcher both pair files this way.
+        static void groupTriplets(std::vector<string>& files, std::vector<string>& rest);
         void destroyHandler();
         void AddDirectory(const char*);
-        void AddDirectory(DIR*, StringPointer&);
+        void AddFiles(const string&, std::vector<string>&);
     };
 
     void Start(FcHandler&);
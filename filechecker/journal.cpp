@@ -0,0 +1,200 @@
+#include "fchecker.h"
+#include "logger.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+#ifdef UNIX_USE_MMAP
+#include <sys/mman.h>
+#endif
+
+namespace
+{
+    const char journalMagic[8] = {'F', 'C', 'J', 'R', 'N', 'L', '0', '1'};
+    const size_t headerSize = sizeof journalMagic;
+    const size_t recordSize = sizeof(uint64_t);
+
+    const uint64_t fnvOffset = 14695981039346656037ull;
+    const uint64_t fnvPrime = 1099511628211ull;
+
+    uint64_t fnv1a(uint64_t h, const void* data, size_t size)
+    {
+        auto ptr = reinterpret_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; i++) {
+            h ^= ptr[i];
+            h *= fnvPrime;
+        }
+        return h;
+    }
+}  // namespace
+
+namespace fc
+{
+    ProcessedJournal* ProcessedJournal::instance = nullptr;
+
+    ProcessedJournal::ProcessedJournal(int _fd) : fd(_fd), loaded(0) {}
+
+    ProcessedJournal::~ProcessedJournal()
+    {
+        if (fd != -1) {
+            fsync(fd);
+            close(fd);
+        }
+    }
+
+    uint64_t ProcessedJournal::buildKey(const char* p, const struct stat& st)
+    {
+        uint64_t size = st.st_size;
+        int64_t mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        uint64_t h = fnv1a(fnvOffset, p, strlen(p));
+        h = fnv1a(h, &size, sizeof size);
+        return fnv1a(h, &mtime, sizeof mtime);
+    }
+
+    int ProcessedJournal::buildKey(const char* p, uint64_t& key)
+    {
+        struct stat st;
+        if (stat(p, &st) == -1) {
+            return -1;
+        }
+        key = buildKey(p, st);
+        return 0;
+    }
+
+    int ProcessedJournal::load(const char* p, char* buffer, size_t bsize)
+    {
+        struct stat st;
+        if (fstat(fd, &st) == -1) {
+            snprintf(buffer, bsize, "Get status of journal %s failed: %s", p, strerror(errno));
+            return -1;
+        }
+        size_t size = st.st_size;
+        if (size == 0) {
+            if (write(fd, journalMagic, headerSize) != static_cast<ssize_t>(headerSize)) {
+                snprintf(buffer, bsize, "Write journal %s failed: %s", p, strerror(errno));
+                return -1;
+            }
+            return 0;
+        }
+        if (size < headerSize) {
+            snprintf(buffer, bsize, "Journal %s is truncated.", p);
+            return -1;
+        }
+#ifdef UNIX_USE_MMAP
+        void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            snprintf(buffer, bsize, "mmap of journal %s failed: %s", p, strerror(errno));
+            return -1;
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+        const char* data = reinterpret_cast<const char*>(map);
+#else
+        std::vector<char> content(size);
+        if (pread(fd, content.data(), size, 0) != static_cast<ssize_t>(size)) {
+            snprintf(buffer, bsize, "Read journal %s failed: %s", p, strerror(errno));
+            return -1;
+        }
+        const char* data = content.data();
+#endif
+        int ret = 0;
+        if (memcmp(data, journalMagic, headerSize) != 0) {
+            snprintf(buffer, bsize, "%s does not appear to be a journal file.", p);
+            ret = -1;
+        } else {
+            loaded = (size - headerSize) / recordSize;
+            keys.reserve(loaded * 2);
+            for (size_t i = 0; i < loaded; i++) {
+                uint64_t k;
+                memcpy(&k, data + headerSize + i * recordSize, recordSize);
+                keys.insert(k);
+            }
+        }
+#ifdef UNIX_USE_MMAP
+        munmap(map, size);
+#endif
+        if (ret == 0 && headerSize + loaded * recordSize != size) {
+            // a crash in the middle of an append leaves a partial record behind
+            if (ftruncate(fd, headerSize + loaded * recordSize) == -1) {
+                snprintf(buffer, bsize, "Truncate journal %s failed: %s", p, strerror(errno));
+                ret = -1;
+            }
+        }
+        return ret;
+    }
+
+    bool ProcessedJournal::contains(uint64_t k) const
+    {
+        _l.read();
+        bool ret = keys.find(k) != keys.end();
+        _l.unlock();
+        return ret;
+    }
+
+    int ProcessedJournal::append(const uint64_t* k, size_t count)
+    {
+        const ssize_t size = count * recordSize;
+        _l.write();
+        keys.insert(k, k + count);
+        auto wrote = write(fd, k, size);
+        _l.unlock();
+        if (wrote != size) {
+            char buffer[256];
+            snprintf(buffer, 256, "Append to processed journal failed: %s", strerror(errno));
+            log_ERROR(buffer);
+            return -1;
+        }
+        return 0;
+    }
+
+    size_t ProcessedJournal::size() const
+    {
+        _l.read();
+        auto ret = keys.size();
+        _l.unlock();
+        return ret;
+    }
+
+    ProcessedJournal* ProcessedJournal::initJournal(const char* p)
+    {
+        assert(instance == nullptr);
+        if (p == nullptr || *p == 0) {
+            return nullptr;
+        }
+        const size_t bsize = strlen(p) + 256;
+        char* buffer = requestMemory(bsize);
+        int fd = open(p, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            snprintf(buffer, bsize, "Open journal %s failed: %s", p, strerror(errno));
+            log_ERROR(buffer);
+            releaseMemory(buffer);
+            return nullptr;
+        }
+        auto j = new ProcessedJournal(fd);
+        if (j->load(p, buffer, bsize) == -1) {
+            log_ERROR(buffer);
+            delete j;
+        } else {
+            snprintf(buffer, bsize, "Journal %s loaded, %lu processed files.", p, j->loaded);
+            log_INFO(buffer);
+            instance = j;
+        }
+        releaseMemory(buffer);
+        return instance;
+    }
+
+    ProcessedJournal* ProcessedJournal::getJournal()
+    {
+        return instance;
+    }
+
+    void ProcessedJournal::destroyJournal()
+    {
+        delete instance;
+        instance = nullptr;
+    }
+}  // namespace fc
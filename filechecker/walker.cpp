@@ -0,0 +1,232 @@
+#include "fchecker.h"
+#include "logger.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+namespace
+{
+    const unsigned long nameMax = 255;
+
+    string joinPath(const string& parent, const char* name)
+    {
+        if (parent.empty()) {
+            return name;
+        }
+        string ret;
+        ret.reserve(parent.length() + strlen(name) + 1);
+        ret.append(parent).append("/").append(name);
+        return ret;
+    }
+
+    void logErrno(const char* fmt, const string& name)
+    {
+        char* buffer = requestMemory(name.length() + nameMax + 128);
+        sprintf(buffer, fmt, name.c_str(), strerror(errno));
+        log_ERROR(buffer);
+        releaseMemory(buffer);
+    }
+}  // namespace
+
+namespace fc
+{
+    DirectoryWalker::Worker::Worker(DirectoryWalker& _w, size_t _i)
+        : thread("walker"), walker(_w), index(_i)
+    {
+    }
+
+    void* DirectoryWalker::Worker::start(void*, void*, void*)
+    {
+        walker.run(index);
+        return nullptr;
+    }
+
+    DirectoryWalker::DirectoryWalker(int count, directoryCallback cb)
+        : callback(cb), rootFD(-1), queued(0), pending(0)
+    {
+        if (count <= 0) {
+            count = 1;
+        }
+        for (int i = 0; i < count; i++) {
+            workers.emplace_back(new Worker(*this, i));
+        }
+    }
+
+    DirectoryWalker::~DirectoryWalker()
+    {
+        for (auto w : workers) {
+            delete w;
+        }
+    }
+
+    void DirectoryWalker::push(size_t index, string&& dir)
+    {
+        auto w = workers[index];
+        pending++;
+        w->_m.lock();
+        w->_q.emplace_back(std::move(dir));
+        w->_m.unlock();
+        queued++;
+
+        idleMutex.lock();
+        idleCV.signal();
+        idleMutex.unlock();
+    }
+
+    bool DirectoryWalker::pop(size_t index, string& dir)
+    {
+        // owner works LIFO on its own deque, so it keeps descending into a hot subtree
+        auto w = workers[index];
+        bool ret = false;
+        w->_m.lock();
+        if (!w->_q.empty()) {
+            dir = std::move(w->_q.back());
+            w->_q.pop_back();
+            ret = true;
+        }
+        w->_m.unlock();
+        if (ret) {
+            queued--;
+        }
+        return ret;
+    }
+
+    bool DirectoryWalker::steal(size_t index, string& dir)
+    {
+        // thieves take the oldest entry, which is usually the largest untouched subtree
+        auto count = workers.size();
+        for (size_t i = 1; i < count; i++) {
+            auto victim = workers[(index + i) % count];
+            bool ret = false;
+            victim->_m.lock();
+            if (!victim->_q.empty()) {
+                dir = std::move(victim->_q.front());
+                victim->_q.pop_front();
+                ret = true;
+            }
+            victim->_m.unlock();
+            if (ret) {
+                queued--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void DirectoryWalker::run(size_t index)
+    {
+        string dir;
+        do {
+            if (pop(index, dir) || steal(index, dir)) {
+                scan(index, dir);
+                if (--pending == 0) {
+                    idleMutex.lock();
+                    idleCV.notify_all();
+                    idleMutex.unlock();
+                }
+                continue;
+            }
+            idleCV.wait(idleMutex, [this] { return queued > 0 || pending == 0; });
+            bool done = pending == 0;
+            idleMutex.unlock();
+            if (done) {
+                break;
+            }
+        } while (true);
+    }
+
+    void DirectoryWalker::scan(size_t index, const string& rel)
+    {
+        const string parent = rel.empty() ? rootPath : joinPath(rootPath, rel.c_str());
+        const int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+        int fd = openat(rootFD, rel.empty() ? "." : rel.c_str(), flags);
+        if (fd == -1) {
+            logErrno("Open Directory %s Failed: %s", parent);
+            return;
+        }
+        DIR* dir = fdopendir(fd);
+        if (dir == nullptr) {
+            logErrno("Open Directory %s Failed: %s", parent);
+            close(fd);
+            return;
+        }
+
+        std::vector<string> files;
+        do {
+            dirent* entry = readdir(dir);
+            if (entry == nullptr) {
+                break;
+            }
+            const char* fname = entry->d_name;
+            if (*fname == '.') {
+                continue;
+            }
+            auto type = entry->d_type;
+            if (type == DT_UNKNOWN || type == DT_LNK) {
+                // follow links like stat(2) did, and ask the inode when d_type is not filled in
+                struct stat st;
+                if (fstatat(fd, fname, &st, 0) == -1) {
+                    logErrno("System Call \"fstatat\" failed with file %s: %s",
+                             joinPath(parent, fname));
+                    continue;
+                }
+                if (S_ISREG(st.st_mode)) {
+                    type = DT_REG;
+                } else if (S_ISDIR(st.st_mode)) {
+                    type = DT_DIR;
+                }
+            }
+            if (type == DT_REG) {
+                files.emplace_back(joinPath(parent, fname));
+            } else if (type == DT_DIR) {
+                push(index, joinPath(rel, fname));
+            } else {
+                auto name = joinPath(parent, fname);
+                char* buffer = requestMemory(name.length() + 128);
+                sprintf(buffer, "Unknown file type %s", name.c_str());
+                log_ERROR(buffer);
+                releaseMemory(buffer);
+            }
+        } while (true);
+        closedir(dir);
+
+        if (files.size() > 0) {
+            callback(parent, files);
+        }
+    }
+
+    int DirectoryWalker::walk(const char* p)
+    {
+        string root = p;
+        tb::utils::formatDirectoryPath(root);
+        rootFD = open(root.empty() ? "." : root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (rootFD == -1) {
+            logErrno("Open Directory %s Failed: %s", root);
+            return -1;
+        }
+        char* buffer = requestMemory(root.length() + 128);
+        sprintf(buffer,
+                "Open Directory %s Success, %lu walker threads",
+                root.c_str(),
+                workers.size());
+        log_TRACE(buffer);
+        releaseMemory(buffer);
+
+        rootPath = root;
+        push(0, string());
+        for (auto w : workers) {
+            w->begin();
+        }
+        for (auto w : workers) {
+            w->join();
+        }
+        close(rootFD);
+        rootFD = -1;
+        return 0;
+    }
+}  // namespace fc
@@ -0,0 +1,339 @@
+#include "fchecker.h"
+#include "logger.h"
+
+#ifdef USE_INOTIFY
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+namespace
+{
+    const uint32_t dirMask =
+        IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_MODIFY
+        | IN_DELETE_SELF | IN_ONLYDIR;
+
+    uint64_t now()
+    {
+        struct timespec spec;
+        clock_gettime(CLOCK_MONOTONIC, &spec);
+        return static_cast<uint64_t>(spec.tv_sec) * 1000 + spec.tv_nsec / 1000000;
+    }
+
+    void logMessage(void (*fn)(const char*), const char* fmt, const char* name, const char* r)
+    {
+        char* buffer = requestMemory(strlen(name) + strlen(r) + 512);
+        sprintf(buffer, fmt, name, r);
+        fn(buffer);
+        releaseMemory(buffer);
+    }
+}  // namespace
+
+namespace fc
+{
+    int DirectoryWatcher::stopPipe[2] = {-1, -1};
+
+    DirectoryWatcher::DirectoryWatcher(int _fd,
+                                       int _debounce,
+                                       DirectoryWalker::directoryCallback cb)
+        : fd(_fd), debounce(_debounce < 0 ? 0 : _debounce), callback(cb)
+    {
+        if (stopPipe[0] == -1) {
+            if (pipe2(stopPipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+                stopPipe[0] = stopPipe[1] = -1;
+            }
+        }
+    }
+
+    DirectoryWatcher::~DirectoryWatcher()
+    {
+        for (auto& d : dirs) {
+            inotify_rm_watch(fd, d.first);
+        }
+    }
+
+    void DirectoryWatcher::signalHandler(int)
+    {
+        stop();
+    }
+
+    void DirectoryWatcher::stop()
+    {
+        if (stopPipe[1] != -1) {
+            char c = 0;
+            auto r = write(stopPipe[1], &c, 1);
+            (void)r;
+        }
+    }
+
+    void DirectoryWatcher::addWatch(const string& p, uint64_t t)
+    {
+        int wd = inotify_add_watch(fd, p.c_str(), dirMask);
+        if (wd == -1) {
+            logMessage(log_ERROR, "inotify_add_watch of %s failed: %s", p.c_str(), strerror(errno));
+            return;
+        }
+        auto& d = dirs[wd];
+        d.path = p;
+        d.deadline = 0;
+        wds[p] = wd;
+
+        // files that were already there, or arrived before the watch was in place, are seeded
+        // as pending; subdirectories get their own watch.
+        DIR* dir = opendir(p.c_str());
+        if (dir == nullptr) {
+            logMessage(log_ERROR, "Open Directory %s Failed: %s", p.c_str(), strerror(errno));
+            return;
+        }
+        std::vector<string> children;
+        do {
+            dirent* entry = readdir(dir);
+            if (entry == nullptr) {
+                break;
+            }
+            const char* fname = entry->d_name;
+            if (*fname == '.') {
+                continue;
+            }
+            unsigned char type = entry->d_type;
+            if (type == DT_UNKNOWN || type == DT_LNK) {
+                struct stat st;
+                if (fstatat(dirfd(dir), fname, &st, 0) == -1) {
+                    continue;
+                }
+                if (S_ISDIR(st.st_mode)) {
+                    type = DT_DIR;
+                } else if (S_ISREG(st.st_mode)) {
+                    type = DT_REG;
+                }
+            }
+            if (type == DT_DIR) {
+                children.emplace_back(p + "/" + fname);
+            } else if (type == DT_REG && addPending(d, fname)) {
+                d.deadline = t + debounce;
+            }
+        } while (true);
+        closedir(dir);
+
+        for (auto& c : children) {
+            if (wds.find(c) == wds.end()) {
+                addWatch(c, t);
+            }
+        }
+    }
+
+    void DirectoryWatcher::removeWatch(int wd)
+    {
+        auto iter = dirs.find(wd);
+        if (iter != dirs.end()) {
+            wds.erase(iter->second.path);
+            dirs.erase(iter);
+        }
+    }
+
+    void DirectoryWatcher::handleEvent(const struct inotify_event* e, uint64_t t)
+    {
+        if ((e->mask & IN_Q_OVERFLOW) == IN_Q_OVERFLOW) {
+            // events were dropped: list every watched directory again
+            log_WARNING("inotify queue overflow, rescanning watched directories.");
+            std::vector<string> all;
+            for (auto& d : dirs) {
+                all.push_back(d.second.path);
+            }
+            for (auto& p : all) {
+                addWatch(p, t);
+            }
+            return;
+        }
+        if ((e->mask & IN_IGNORED) == IN_IGNORED || (e->mask & IN_DELETE_SELF) == IN_DELETE_SELF) {
+            removeWatch(e->wd);
+            return;
+        }
+        auto iter = dirs.find(e->wd);
+        if (iter == dirs.end() || e->len == 0 || e->name[0] == '.') {
+            return;
+        }
+        auto& d = iter->second;
+        const char* name = e->name;
+
+        if ((e->mask & IN_ISDIR) == IN_ISDIR) {
+            if ((e->mask & (IN_CREATE | IN_MOVED_TO)) != 0) {
+                addWatch(d.path + "/" + name, t);
+            }
+            return;
+        }
+        if ((e->mask & (IN_DELETE | IN_MOVED_FROM)) != 0) {
+            d.pending.erase(name);
+            d.emitted.erase(name);
+        } else if ((e->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) != 0) {
+            addPending(d, name);
+        }
+        if (d.pending.size() > 0) {
+            // any activity in the directory postpones the hand-off
+            d.deadline = t + debounce;
+        }
+    }
+
+    bool DirectoryWatcher::addPending(Directory& d, const char* name)
+    {
+        if (d.emitted.count(name) != 0) {
+            return false;
+        }
+        int n = FcHandler::getNumber((d.path + "/" + name).c_str());
+        if (n < 0) {
+            return false;
+        }
+        d.pending.emplace(name);
+        return true;
+    }
+
+    // forgets the files the journal has recorded by now, a rescan hands them out again and
+    // AddFiles skips them
+    void DirectoryWatcher::prune(Directory& d)
+    {
+        auto journal = ProcessedJournal::getJournal();
+        for (auto iter = d.emitted.begin(); iter != d.emitted.end();) {
+            uint64_t key;
+            if (journal == nullptr
+                || ProcessedJournal::buildKey((d.path + "/" + *iter).c_str(), key) == -1
+                || journal->contains(key)) {
+                iter = d.emitted.erase(iter);
+            } else {
+                iter++;
+            }
+        }
+    }
+
+    int DirectoryWatcher::flush(uint64_t t)
+    {
+        uint64_t next = 0;
+        for (auto& iter : dirs) {
+            auto& d = iter.second;
+            if (d.deadline == 0) {
+                continue;
+            }
+            if (d.deadline > t) {
+                next = next == 0 ? d.deadline : std::min(next, d.deadline);
+                continue;
+            }
+            d.deadline = 0;
+            prune(d);
+            // only whole triplets go out, the rest waits for its missing files
+            std::vector<string> files, rest;
+            for (auto& f : d.pending) {
+                files.emplace_back(d.path + "/" + f);
+            }
+            FcHandler::groupTriplets(files, rest);
+            for (auto& f : files) {
+                auto name = f.substr(d.path.size() + 1);
+                d.pending.erase(name);
+                if (ProcessedJournal::getJournal() != nullptr) {
+                    d.emitted.emplace(std::move(name));
+                }
+            }
+            if (files.size() > 0) {
+                callback(d.path, files);
+            }
+        }
+        if (next == 0) {
+            return -1;
+        }
+        return static_cast<int>(next - t);
+    }
+
+    int DirectoryWatcher::watch(const char* p)
+    {
+        string root = p;
+        tb::utils::formatDirectoryPath(root);
+
+        struct sigaction act;
+        memset(&act, 0, sizeof act);
+        act.sa_handler = &DirectoryWatcher::signalHandler;
+        sigemptyset(&act.sa_mask);
+        sigaction(SIGINT, &act, nullptr);
+        sigaction(SIGTERM, &act, nullptr);
+
+        addWatch(root, now());
+        logMessage(log_INFO,
+                   "Watching %s for new triplets, %s directories.",
+                   root.c_str(),
+                   std::to_string(dirs.size()).c_str());
+
+        const size_t bsize = 64 * (sizeof(struct inotify_event) + NAME_MAX + 1);
+        std::vector<char> buffer(bsize);
+        struct pollfd fds[2];
+        memset(fds, 0, sizeof fds);
+        fds[0].fd = fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = stopPipe[0];
+        fds[1].events = POLLIN;
+
+        do {
+            int timeout = flush(now());
+            int ret = poll(fds, stopPipe[0] == -1 ? 1 : 2, timeout);
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                logMessage(log_ERROR,
+                           "poll on inotify descriptor of %s failed: %s",
+                           root.c_str(),
+                           strerror(errno));
+                break;
+            }
+            if (ret > 0 && stopPipe[0] != -1 && (fds[1].revents & POLLIN) == POLLIN) {
+                log_INFO("Stop watching, draining pending directories.");
+                break;
+            }
+            if (ret > 0 && (fds[0].revents & POLLIN) == POLLIN) {
+                auto len = read(fd, buffer.data(), bsize);
+                if (len <= 0) {
+                    continue;
+                }
+                auto t = now();
+                for (char* ptr = buffer.data(); ptr < buffer.data() + len;) {
+                    auto e = reinterpret_cast<const struct inotify_event*>(ptr);
+                    handleEvent(e, t);
+                    ptr += sizeof(struct inotify_event) + e->len;
+                }
+            }
+        } while (true);
+
+        // hand out whatever already forms complete triplets
+        for (auto& d : dirs) {
+            if (d.second.deadline != 0) {
+                d.second.deadline = 1;
+            }
+        }
+        flush(now());
+        for (auto& d : dirs) {
+            if (d.second.pending.size() == 0) {
+                continue;
+            }
+            string names;
+            for (auto& f : d.second.pending) {
+                names += names.empty() ? f : ", " + f;
+            }
+            logMessage(log_WARNING,
+                       "Files in %s left without a complete triplet: %s",
+                       d.second.path.c_str(),
+                       names.c_str());
+        }
+
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        return 0;
+    }
+}  // namespace fc
+
+#endif
@@ -0,0 +1,298 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include "threads.h"
+
+#include <curl/curl.h>
+#include <sys/epoll.h>
+
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <map>
+#include <queue>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace tb
+{
+    namespace async
+    {
+        template <class T = void>
+        class task;
+
+        namespace detail
+        {
+            struct promise_base {
+                std::coroutine_handle<> continuation;
+
+                struct final_awaiter {
+                    bool await_ready() noexcept
+                    {
+                        return false;
+                    }
+                    template <class P>
+                    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+                    {
+                        auto c = h.promise().continuation;
+                        return c ? c : std::noop_coroutine();
+                    }
+                    void await_resume() noexcept {}
+                };
+
+                std::suspend_always initial_suspend() noexcept
+                {
+                    return {};
+                }
+                final_awaiter final_suspend() noexcept
+                {
+                    return {};
+                }
+                // nothing in the project throws
+                void unhandled_exception()
+                {
+                    std::terminate();
+                }
+            };
+
+            template <class T>
+            struct promise : promise_base {
+                T value{};
+
+                task<T> get_return_object();
+                void return_value(T v)
+                {
+                    value = std::move(v);
+                }
+            };
+
+            template <>
+            struct promise<void> : promise_base {
+                task<void> get_return_object();
+                void return_void() {}
+            };
+        }  // namespace detail
+
+        // Lazily started coroutine returning T. Awaiting a task runs it and resumes the
+        // awaiting coroutine from its final suspend (symmetric transfer), so long chains of
+        // tasks do not grow the stack. Top level tasks are started with event_loop::spawn().
+        template <class T>
+        class task
+        {
+        public:
+            using promise_type = detail::promise<T>;
+
+        private:
+            std::coroutine_handle<promise_type> coro;
+
+        public:
+            explicit task(std::coroutine_handle<promise_type> h) : coro(h) {}
+            task(task&& o) noexcept : coro(std::exchange(o.coro, nullptr)) {}
+            task(const task&) = delete;
+            ~task()
+            {
+                if (coro) {
+                    coro.destroy();
+                }
+            }
+
+            bool await_ready() const noexcept
+            {
+                return !coro || coro.done();
+            }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) noexcept
+            {
+                coro.promise().continuation = h;
+                return coro;
+            }
+            T await_resume()
+            {
+                if constexpr (!std::is_void<T>::value) {
+                    return std::move(coro.promise().value);
+                }
+            }
+        };
+
+        namespace detail
+        {
+            template <class T>
+            task<T> promise<T>::get_return_object()
+            {
+                return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+            }
+
+            inline task<void> promise<void>::get_return_object()
+            {
+                return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+            }
+        }  // namespace detail
+
+        // Single threaded epoll reactor. Coroutines started with spawn() run on the loop
+        // thread and suspend on wait() for socket readiness or on sleep(). post(), spawn()
+        // and stop() may be called from any thread, everything else only on the loop thread.
+        class event_loop : public tb::thread_ns::thread
+        {
+        public:
+            using callback = std::function<void()>;
+            using ioCallback = std::function<void(uint32_t)>;
+
+            struct io_awaiter {
+                event_loop& loop;
+                int fd;
+                uint32_t events;
+                uint32_t revents;
+
+                bool await_ready() const noexcept
+                {
+                    return false;
+                }
+                void await_suspend(std::coroutine_handle<> h)
+                {
+                    loop.watch(fd, events, [this, h](uint32_t ev) {
+                        revents = ev;
+                        loop.unwatch(fd);
+                        h.resume();
+                    });
+                }
+                uint32_t await_resume() const noexcept
+                {
+                    return revents;
+                }
+            };
+
+            struct sleep_awaiter {
+                event_loop& loop;
+                uint64_t us;
+
+                bool await_ready() const noexcept
+                {
+                    return false;
+                }
+                void await_suspend(std::coroutine_handle<> h)
+                {
+                    loop.after(us, [h] { h.resume(); });
+                }
+                void await_resume() const noexcept {}
+            };
+
+        private:
+            struct timer {
+                uint64_t deadline;
+                uint64_t seq;
+                callback fn;
+
+                bool operator>(const timer& o) const
+                {
+                    return deadline != o.deadline ? deadline > o.deadline : seq > o.seq;
+                }
+            };
+
+            int epfd;
+            int wakefd;
+            std::atomic<bool> running;
+
+            tb::thread_ns::mutex _m;
+            std::vector<callback> posted;
+
+            std::map<int, ioCallback> watchers;
+            std::priority_queue<timer, std::vector<timer>, std::greater<timer>> timers;
+            uint64_t seq;
+
+            virtual void* start(void*, void*, void*) override;
+            void runPosted();
+            void runTimers();
+            int nextTimeout();
+
+        public:
+            explicit event_loop(const char* = "ioloop");
+            virtual ~event_loop();
+            event_loop(const event_loop&) = delete;
+
+            void post(callback);
+            void spawn(task<void>);
+            void stop();
+
+            // one watcher per descriptor, a second watch() replaces the first
+            void watch(int, uint32_t, ioCallback);
+            void unwatch(int);
+            void after(uint64_t, callback);
+
+            io_awaiter wait(int fd, uint32_t events)
+            {
+                return {*this, fd, events, 0};
+            }
+            sleep_awaiter sleep(uint64_t us)
+            {
+                return {*this, us};
+            }
+        };
+
+        // Drives libcurl's multi interface from an event_loop: curl tells the loop which
+        // sockets and which timeout to watch and the loop calls back into
+        // curl_multi_socket_action(). Every request is a coroutine awaiting perform(), so any
+        // number of them share the loop thread and the connection cache.
+        class http_client
+        {
+            struct transfer {
+                CURL* easy;
+                std::coroutine_handle<> waiter;
+                CURLcode result;
+            };
+
+            event_loop& loop;
+            CURLM* multi;
+            // curl keeps a single timeout, stale timers compare against this
+            uint64_t timerGeneration;
+
+            static int onSocket(CURL*, curl_socket_t, int, void*, void*);
+            static int onTimer(CURLM*, long, void*);
+            static size_t onData(char*, size_t, size_t, void*);
+            void action(curl_socket_t, int);
+            void collect();
+
+        public:
+            struct perform_awaiter {
+                http_client& client;
+                transfer t;
+
+                bool await_ready() const noexcept
+                {
+                    return false;
+                }
+                void await_suspend(std::coroutine_handle<> h)
+                {
+                    t.waiter = h;
+                    curl_easy_setopt(t.easy, CURLOPT_PRIVATE, &t);
+                    curl_multi_add_handle(client.multi, t.easy);
+                }
+                CURLcode await_resume() const noexcept
+                {
+                    return t.result;
+                }
+            };
+
+            explicit http_client(event_loop&);
+            ~http_client();
+            http_client(const http_client&) = delete;
+
+            event_loop& getLoop()
+            {
+                return loop;
+            }
+
+            perform_awaiter perform(CURL* easy)
+            {
+                return {*this, {easy, nullptr, CURLE_OK}};
+            }
+
+            // form POST, the HTTP status is returned, 0 if the transfer itself failed
+            task<long> post(std::string url, std::string body, std::string& response,
+                            CURLcode& code, long timeoutMs = 30000);
+        };
+    }  // namespace async
+}  // namespace tb
+
+#endif
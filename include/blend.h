@@ -0,0 +1,26 @@
+#ifndef BLEND_H
+#define BLEND_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace tb
+{
+    namespace blend
+    {
+        // dst[i] = dst[i] × inverse[i] / 255 + premultiplied[i], rounded and saturated, for n
+        // bytes. The planes are interleaved like dst (BGR, BGRA, ...) with the inverse alpha
+        // repeated for every channel, so the kernels never shuffle and need no scratch memory.
+        using kernel = void (*)(uint8_t*, const uint8_t*, const uint8_t*, size_t);
+
+        // the fastest kernel this CPU runs, picked on first use
+        void overlay(uint8_t* dst, const uint8_t* premultiplied, const uint8_t* inverse, size_t n);
+
+        // "avx2", "sse4.1" or "scalar"; nullptr if unknown or not supported by this CPU
+        kernel find(const char* name);
+        // name of the kernel overlay() uses
+        const char* implementation();
+    }  // namespace blend
+}  // namespace tb
+
+#endif
@@ -11,6 +11,9 @@
 #include <queue>
 #include <string>
 
+#include "async.h"
+#include "jpeg.h"
+#include "limiter.h"
 #include "logger.h"
 #include "taobao.h"
 #include "threads.h"
@@ -58,6 +61,11 @@ namespace fc
     int ImageProcessingStartup(const Json::Value&);
     int ImageProcessingStartup(const string&, const string&, const string&);
 
+    // Looks for the bar code in the bottom 60% of a board. With `detectWidth` > 0 the strip is
+    // shrunk by a whole factor to about that many pixels first, 0 runs at full resolution.
+    // `roi` is in board pixels; -1 if nothing wide enough was found.
+    int findBarCodeROI(const cv::Mat& board, cv::Rect& roi, int detectWidth = 0);
+
     using tb::thread_ns::condition_variable;
     using tb::thread_ns::mutex;
     using tb::thread_ns::thread;
@@ -70,6 +78,8 @@ namespace fc
     {
     protected:
         const string filename;
+        const unsigned int mask;
+        int decodeWidth;
         Mat imageMat;
         tb::thread_ns::rwlock _l;
 
@@ -82,8 +92,18 @@ namespace fc
         {
             _l.unlock();
         }
-        BaseImage(const char* filename, unsigned int mask = cv::IMREAD_COLOR);
+        BaseImage(const char* filename, unsigned int mask = cv::IMREAD_COLOR, bool = false);
         bool valid() const;
+        bool load();
+        // let load() use libjpeg DCT scaling as long as the result stays at least this wide
+        void setDecodeWidth(int w)
+        {
+            decodeWidth = w;
+        }
+        bool loaded() const
+        {
+            return !imageMat.empty();
+        }
         virtual ~BaseImage() {}
         const Mat& getMat() const
         {
@@ -91,6 +111,8 @@ namespace fc
         }
         void resize(double);
         void resize(const cv::Size&);
+        // frees the pixels once nothing needs them any more
+        void release();
         void rotateScale(const cv::Point&, double, double);
     };
 
@@ -103,12 +125,17 @@ namespace fc
 
     public:
         Image(const char*);
-        Image(const char*, size_t);
+        Image(const char*, bool);
         Image();
         int OpenImageFile(const char*);
         int WriteToFile(const char* = nullptr, const vector<int>& = vector<int>());
+        // JPEG of the current picture into `out`, see tb::jpeg::encode()
+        bool encode(const tb::jpeg::options&, std::vector<uint8_t>& out);
 
-        int getBarCode(string&, int* = nullptr);
+        // `detectWidth` as for findBarCodeROI()
+        int getBarCode(string&, int* = nullptr, int detectWidth = 0);
+        // one cheap zbar scan in `window` (x, y, width, height) widened by a margin, no search
+        int readBarCode(string&, const int* window);
 
         int getItemAccurateCode(string&, string&, int& price, int&, OcrResult&);
         int getItemCode(string&, string&, int& price, int&, OcrResult&, int* = nullptr);
@@ -122,11 +149,21 @@ namespace fc
         friend int ImageProcessingDestroy();
         friend class Image;
 
+    public:
+        // marker colour premultiplied by alpha × transparent next to 255 - alpha × transparent
+        // repeated per channel, both BGR, the layout tb::blend::overlay() takes
+        struct Overlay {
+            Mat premultiplied;
+            Mat inverseAlpha;
+        };
+        // images narrower than this get the marker shrunk to 70%
+        static const int smallWidth = 1000;
+
+    private:
         static std::vector<WaterMarker*> markers;
 
         mutable tb::thread_ns::rwlock _lock;
 
-        std::tuple<Mat*, Mat*> small;
         string id;
         string waterMarkerPath;
         string position;
@@ -139,17 +176,18 @@ namespace fc
         int yOffset;
 
         BaseImage* waterMarker;
-        Mat waterMarkerMask;
+        // full size and small, built once at startup and only read afterwards, so images
+        // take them without locking
+        Overlay overlays[2];
         bool CheckWaterMarker(char*, size_t);
 
-        void buildMask();
-        void buildSmall();
+        void buildOverlays();
 
     public:
-        const std::tuple<Mat*, Mat*>& getSmall() const
+        const Overlay& getOverlay(int baseWidth) const
         {
-            return small;
-        };
+            return overlays[baseWidth < smallWidth ? 1 : 0];
+        }
 
         void read() const
         {
@@ -256,11 +294,35 @@ namespace fc
         {282810, "image recognize error"},
     };
 
+    // ProcessingOCR result when the API refused the request because of a quota; the caller
+    // should retry the item without counting it as failed.
+    const int OCR_THROTTLED = -2;
+
     int ProcessingOCR(
         const string&, std::vector<string>&, uint64_t&, string&, int&, string&, int&, bool = false);
 
     int ProcessingOCR(const string&, OcrResult&, int&, bool = false);
 
+    // Baidu OCR over its REST API on an event loop, so any number of requests can be in
+    // flight without a thread each. recognize() runs on the loop thread and ends like
+    // ProcessingOCR, OCR_THROTTLED included. The access token is fetched on first use and
+    // again once the API reports it invalid or expired.
+    class OcrClient
+    {
+        tb::async::http_client& http;
+        string token;
+        uint64_t tokenExpiry;
+        bool refreshing;
+
+        tb::async::task<bool> refreshToken();
+
+    public:
+        OcrClient(tb::async::http_client&);
+        // reads and encodes the image into the form body, CPU work kept off the loop
+        static bool buildRequest(const string&, string&);
+        tb::async::task<int> recognize(string, OcrResult&, int&, bool = false);
+    };
+
     int ImageProcessingDestroy();
 };  // namespace fc
 
@@ -0,0 +1,37 @@
+#ifndef JPEG_H
+#define JPEG_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace tb
+{
+    namespace jpeg
+    {
+        enum subsampling { SAMP_444 = 0, SAMP_422 = 1, SAMP_420 = 2 };
+
+        struct options {
+            int quality = 95;
+            subsampling sampling = SAMP_420;
+            // two pass Huffman tables, a few percent smaller for some CPU
+            bool optimize = false;
+            bool progressive = false;
+        };
+
+        // "444", "422" or "420"; false leaves `s` untouched
+        bool parseSubsampling(const char*, subsampling& s);
+
+        // Encodes 8 bit BGR rows (`stride` bytes apart) with libjpeg(-turbo) into `out`. Every
+        // thread keeps one compressor and `out` keeps its capacity, so encoding into a reused
+        // buffer allocates nothing. false if libjpeg reported an error, `out` is empty then.
+        bool encode(const uint8_t* bgr,
+                    int width,
+                    int height,
+                    size_t stride,
+                    const options&,
+                    std::vector<uint8_t>& out);
+    }  // namespace jpeg
+}  // namespace tb
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef LIMITER_H
+#define LIMITER_H
+
+#include <cstdint>
+
+#include "metrics.h"
+#include "threads.h"
+
+namespace fc
+{
+    // Token bucket in front of the OCR client. The rate grows additively with every accepted
+    // request up to image.ocr.qps and is halved on QPS/request limit errors (18, 4); daily
+    // (17) or total (19) quota errors pause every request until the next local midnight.
+    class OcrLimiter
+    {
+    public:
+        enum State { RUNNING = 0, BACKOFF = 1, PAUSED = 2 };
+
+    private:
+        static OcrLimiter* instance;
+
+        mutable tb::thread_ns::mutex _m;
+        double maxRate;
+        double minRate;
+        double step;
+        double rate;
+        double tokens;
+        uint64_t last;
+        uint64_t lastDecrease;
+        uint64_t pauseUntil;
+        State state;
+        bool stopped;
+        uint64_t throttled;
+
+        uint64_t (*clock)();
+
+        void publish();
+
+    public:
+        // `clock` in microseconds, tests drive their own
+        explicit OcrLimiter(uint64_t (*clock)() = tb::metrics::now);
+
+        static OcrLimiter& getLimiter();
+        static void destroyLimiter();
+
+        void configure(double max, double min, double step);
+        // blocks until a request may be sent, false once stop()ped
+        bool acquire();
+        // takes a token if one is there: 0 then, else the microseconds to wait before asking
+        // again, -1 once stop()ped
+        int64_t tryAcquire();
+        // feeds an API error code (0 on success) back, true if it was a throttling error
+        bool report(int);
+        // wakes every waiter for good, requests fail from then on
+        void stop();
+
+        double getRate() const;
+        State getState() const;
+        uint64_t getThrottled() const;
+    };
+}  // namespace fc
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef MATPOOL_H
+#define MATPOOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "threads.h"
+
+namespace tb
+{
+    namespace matpool
+    {
+        struct Stats {
+            // served from a free list
+            uint64_t hits;
+            // went to the system allocator
+            uint64_t misses;
+            // released while the free lists were at the cap, handed back to the system
+            uint64_t dropped;
+            // bytes waiting in the free lists
+            size_t cached;
+        };
+
+        // Free lists of large page aligned buffers, one size class per quarter power of two.
+        // Every thread keeps a couple of buffers per class for itself, the rest goes to a
+        // shared depot, so a buffer decoded on one thread and freed on another is still reused.
+        // Released buffers are kept while all lists together hold less than `cap` bytes. A pool
+        // has to outlive every thread that used it.
+        class Pool
+        {
+        public:
+            // classes cover 4 KiB to 4 GiB
+            static const int classCount = 80;
+            // buffers a thread keeps per class before it fills the depot
+            static const int localDepth = 2;
+
+        private:
+            struct Cache;
+
+            const size_t cap;
+            const size_t minimum;
+            tb::thread_ns::mutex _m;
+            std::vector<void*> depot[classCount];
+            std::atomic<size_t> cached;
+            std::atomic<uint64_t> hits;
+            std::atomic<uint64_t> misses;
+            std::atomic<uint64_t> dropped;
+
+            static Cache& local();
+
+        public:
+            Pool(size_t cap, size_t minimum);
+            Pool(const Pool&) = delete;
+            ~Pool();
+
+            // the size a request is rounded up to, 0 if it is outside the classes
+            static size_t classSize(size_t);
+
+            size_t getMinimum() const
+            {
+                return minimum;
+            }
+            // nullptr below `minimum`, above the largest class or when the system is out of
+            // memory
+            void* acquire(size_t);
+            // `size` is the one passed to acquire()
+            void release(void*, size_t size);
+            // hands the calling thread's buffers to the depot
+            void flush();
+            void stats(Stats&) const;
+        };
+
+        // Makes a pool cv::Mat's default allocator. Matrices of at least `minimum` bytes take
+        // their data from it, smaller ones keep using OpenCV's allocator. Call it before the
+        // pipeline threads start; the pool stays installed until the process exits.
+        void install(size_t cap, size_t minimum = 256 << 10);
+        // false if install() was never called
+        bool stats(Stats&);
+    }  // namespace matpool
+}  // namespace tb
+
+#endif
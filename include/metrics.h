@@ -0,0 +1,159 @@
+#ifndef METRICS_H
+#define METRICS_H
+#include "taobao.h"
+#include "threads.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace tb
+{
+    namespace metrics
+    {
+        uint64_t now();
+
+        // Per-stage counters of a queue-fed pipeline stage. Each thread updates its own
+        // cache-line sized shard with relaxed atomics, a snapshot sums the shards, so the hot
+        // path never touches a shared line or a lock.
+        class Stage
+        {
+        public:
+            // bucket i counts service times below 2^i microseconds, the last one is +Inf
+            static const int bucketCount = 28;
+            static const int shardCount = 16;
+
+            struct Snapshot {
+                uint64_t in;
+                uint64_t out;
+                uint64_t failed;
+                uint64_t count;
+                uint64_t sum;
+                uint64_t buckets[bucketCount];
+            };
+
+        private:
+            // whole cache lines, so neighbouring shards never share one
+            struct alignas(64) Shard {
+                std::atomic<uint64_t> in;
+                std::atomic<uint64_t> out;
+                std::atomic<uint64_t> failed;
+                std::atomic<uint64_t> count;
+                std::atomic<uint64_t> sum;
+                std::atomic<uint64_t> buckets[bucketCount];
+            };
+
+            const std::string name;
+            Shard shards[shardCount];
+
+            Shard& local();
+
+        public:
+            explicit Stage(const char*);
+            Stage(const Stage&) = delete;
+
+            const std::string& getName() const
+            {
+                return name;
+            }
+            // an item entered the stage queue
+            void enqueue();
+            // an item left the stage queue
+            void dequeue();
+            // an item was dropped by the stage
+            void fail();
+            // service time of one item in microseconds
+            void observe(uint64_t);
+            void snapshot(Snapshot&) const;
+        };
+
+        // A single value that is set rather than accumulated, e.g. a configured rate.
+        class Gauge
+        {
+            const std::string name;
+            const std::string help;
+            std::atomic<double> value;
+
+        public:
+            Gauge(const char* n, const char* h) : name(n), help(h), value(0) {}
+            Gauge(const Gauge&) = delete;
+
+            const std::string& getName() const
+            {
+                return name;
+            }
+            const std::string& getHelp() const
+            {
+                return help;
+            }
+            void set(double v)
+            {
+                value.store(v, std::memory_order_relaxed);
+            }
+            double get() const
+            {
+                return value.load(std::memory_order_relaxed);
+            }
+        };
+
+        // Measures the lifetime of the object into a Stage.
+        class ScopedTimer
+        {
+            Stage& stage;
+            uint64_t begin;
+
+        public:
+            explicit ScopedTimer(Stage& s) : stage(s), begin(now()) {}
+            ~ScopedTimer()
+            {
+                stage.observe(now() - begin);
+            }
+        };
+
+        class Registry : public tb::thread_ns::thread
+        {
+            static Registry* instance;
+
+            tb::thread_ns::mutex _m;
+            std::vector<Stage*> stages;
+            std::vector<Gauge*> gauges;
+            std::string path;
+            unsigned int interval;
+            std::atomic<bool> running;
+            // cuts the reporter's wait short on stop()
+            tb::thread_ns::event_count wake;
+
+            Registry();
+            virtual void* start(void*, void*, void*) override;
+
+        public:
+            virtual ~Registry();
+            static Registry& getRegistry();
+            static void destroyRegistry();
+
+            // stages live as long as the registry, the same name returns the same stage
+            Stage& stage(const char*);
+            // exported as fchecker_<name>
+            Gauge& gauge(const char*, const char*);
+            // Prometheus text exposition of every stage
+            std::string format();
+            int writeFile();
+            // snapshots are written to p every `interval` seconds until stop()
+            void startReporter(const char* p, unsigned int interval);
+            void stop();
+        };
+
+        inline Stage& stage(const char* n)
+        {
+            return Registry::getRegistry().stage(n);
+        }
+
+        inline Gauge& gauge(const char* n, const char* help)
+        {
+            return Registry::getRegistry().gauge(n, help);
+        }
+    }  // namespace metrics
+}  // namespace tb
+
+#endif
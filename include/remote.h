@@ -6,6 +6,10 @@
 #include "taobao.h"
 #include "threads.h"
 
+#ifdef BUILD_WITH_LIBSSH
+#include "async.h"
+#endif
+
 #include <mysql.h>
 
 #ifdef BUILD_WITH_LIBSSH
@@ -57,6 +61,8 @@ namespace tb
             int _socket;
             LIBSSH2_SESSION* _session;
             LIBSSH2_SFTP* _sftpsession;
+            // set once the session is non-blocking and driven by this loop
+            tb::async::event_loop* loop;
 
             int errNo;
             char* errString;
@@ -70,6 +76,9 @@ namespace tb
 
             int mkparent(const string&);
             int SFTPMkParentDir(const string&);
+            tb::async::task<int> mkparentAsync(string);
+            // waits until the socket is ready the way the last EAGAIN asked for
+            tb::async::event_loop::io_awaiter blocked();
 
             void checkSSHError()
             {
@@ -92,7 +101,14 @@ namespace tb
                 csr, csr, csr, csr, csr, csr, unsigned int, bool, bool = true);
             static void destrypSFTPInstance();
 
+            // blocking upload, only before attach()
             int sendFile(const char*, const char*);
+            // Switches the connected session to non-blocking mode on the loop; uploads go
+            // through sendFileAsync() on the loop thread from then on, one at a time.
+            void attach(tb::async::event_loop&);
+            tb::async::task<int> sendFileAsync(string, string);
+            // uploads `size` bytes as the remote file, `data` has to outlive the task
+            tb::async::task<int> sendBufferAsync(const char* data, size_t size, string, int = 0644);
 
             const char* tryConnect();
         };
@@ -146,7 +162,8 @@ namespace tb
             virtual void* start(void*, void*, void*) override;
 
             void beginTransation();
-            void commit();
+            // 0 once the transaction is committed
+            int commit();
             int query(const char*);
 
             const char* getRemoteServerInfo();
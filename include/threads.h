@@ -19,6 +19,25 @@
 #else
 #error "Please choose a thread library."
 #endif
+#include <atomic>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <time.h>
+#ifdef UNIX_HAVE_LINUX_FUTEX
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#endif
 
 namespace tb
 {
@@ -311,6 +330,760 @@ namespace tb
             }
         };
 #endif
+
+        // CLOCK_MONOTONIC in microseconds, the time base of every deadline below
+        inline uint64_t monotonic_us()
+        {
+            struct timespec spec;
+            clock_gettime(CLOCK_MONOTONIC, &spec);
+            return static_cast<uint64_t>(spec.tv_sec) * 1000000 + spec.tv_nsec / 1000;
+        }
+
+        // Lets threads sleep until some lock-free condition may have changed. A waiter takes
+        // a key with prepare(), re-checks its condition, then wait(key)s; notify_* after the
+        // condition changed makes that wait return. Notifiers skip the syscall while nobody
+        // is waiting.
+        class event_count
+        {
+            std::atomic<uint32_t> epoch;
+            std::atomic<int> waiters;
+#ifndef UNIX_HAVE_LINUX_FUTEX
+            std::mutex _m;
+            std::condition_variable _cv;
+#endif
+
+            void wake(int count)
+            {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (waiters.load(std::memory_order_relaxed) == 0) {
+                    return;
+                }
+#ifdef UNIX_HAVE_LINUX_FUTEX
+                epoch.fetch_add(1, std::memory_order_release);
+                syscall(SYS_futex, &epoch, FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+#else
+                {
+                    std::lock_guard<std::mutex> g(_m);
+                    epoch.fetch_add(1, std::memory_order_release);
+                }
+                if (count == 1) {
+                    _cv.notify_one();
+                } else {
+                    _cv.notify_all();
+                }
+#endif
+            }
+
+        public:
+            event_count() : epoch(0), waiters(0) {}
+            event_count(const event_count&) = delete;
+
+            uint32_t prepare()
+            {
+                waiters.fetch_add(1, std::memory_order_seq_cst);
+                return epoch.load(std::memory_order_acquire);
+            }
+            // gives up a prepare() without sleeping
+            void cancel()
+            {
+                waiters.fetch_sub(1, std::memory_order_relaxed);
+            }
+            void wait(uint32_t key)
+            {
+#ifdef UNIX_HAVE_LINUX_FUTEX
+                while (epoch.load(std::memory_order_acquire) == key) {
+                    syscall(SYS_futex, &epoch, FUTEX_WAIT_PRIVATE, key, nullptr, nullptr, 0);
+                }
+#else
+                std::unique_lock<std::mutex> l(_m);
+                _cv.wait(l, [&] { return epoch.load(std::memory_order_acquire) != key; });
+#endif
+                waiters.fetch_sub(1, std::memory_order_relaxed);
+            }
+            // as wait(), but gives up after `us` microseconds; false then
+            bool wait_for(uint32_t key, uint64_t us)
+            {
+                bool woken = true;
+#ifdef UNIX_HAVE_LINUX_FUTEX
+                auto deadline = monotonic_us() + us;
+                while (epoch.load(std::memory_order_acquire) == key) {
+                    auto t = monotonic_us();
+                    if (t >= deadline) {
+                        woken = false;
+                        break;
+                    }
+                    struct timespec left;
+                    left.tv_sec = (deadline - t) / 1000000;
+                    left.tv_nsec = (deadline - t) % 1000000 * 1000;
+                    syscall(SYS_futex, &epoch, FUTEX_WAIT_PRIVATE, key, &left, nullptr, 0);
+                }
+#else
+                std::unique_lock<std::mutex> l(_m);
+                woken = _cv.wait_for(l, std::chrono::microseconds(us), [&] {
+                    return epoch.load(std::memory_order_acquire) != key;
+                });
+#endif
+                waiters.fetch_sub(1, std::memory_order_relaxed);
+                return woken;
+            }
+            void notify_one()
+            {
+                wake(1);
+            }
+            void notify_all()
+            {
+                wake(INT_MAX);
+            }
+        };
+
+        // Bounded multi-producer multi-consumer queue (Vyukov's array queue). Every cell
+        // carries a sequence number telling producers and consumers whose turn it is, so
+        // push and pop are a single CAS on the uncontended path. Threads only block, on an
+        // event_count, while the queue is full or empty. close() replaces sentinel items:
+        // push fails from then on and pop drains what is left, then returns false.
+        template <class T>
+        class mpmc_queue
+        {
+            struct cell {
+                std::atomic<size_t> seq;
+                T data;
+            };
+
+            static const size_t cacheLine = 64;
+
+            cell* buffer;
+            size_t mask;
+            char pad0[cacheLine];
+            std::atomic<size_t> enqueuePos;
+            char pad1[cacheLine - sizeof(std::atomic<size_t>)];
+            std::atomic<size_t> dequeuePos;
+            char pad2[cacheLine - sizeof(std::atomic<size_t>)];
+            std::atomic<bool> _closed;
+            event_count notEmpty;
+            event_count notFull;
+
+            static size_t roundUp(size_t c)
+            {
+                size_t r = 2;
+                while (r < c) {
+                    r <<= 1;
+                }
+                return r;
+            }
+
+            template <class U>
+            bool enqueue(U&& v)
+            {
+                size_t pos = enqueuePos.load(std::memory_order_relaxed);
+                do {
+                    cell* c = &buffer[pos & mask];
+                    size_t seq = c->seq.load(std::memory_order_acquire);
+                    intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+                    if (diff == 0) {
+                        if (enqueuePos.compare_exchange_weak(
+                                pos, pos + 1, std::memory_order_relaxed)) {
+                            c->data = std::forward<U>(v);
+                            c->seq.store(pos + 1, std::memory_order_release);
+                            return true;
+                        }
+                    } else if (diff < 0) {
+                        return false;
+                    } else {
+                        pos = enqueuePos.load(std::memory_order_relaxed);
+                    }
+                } while (true);
+            }
+
+            bool dequeue(T& v)
+            {
+                size_t pos = dequeuePos.load(std::memory_order_relaxed);
+                do {
+                    cell* c = &buffer[pos & mask];
+                    size_t seq = c->seq.load(std::memory_order_acquire);
+                    intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+                    if (diff == 0) {
+                        if (dequeuePos.compare_exchange_weak(
+                                pos, pos + 1, std::memory_order_relaxed)) {
+                            v = std::move(c->data);
+                            c->data = T();
+                            c->seq.store(pos + mask + 1, std::memory_order_release);
+                            return true;
+                        }
+                    } else if (diff < 0) {
+                        return false;
+                    } else {
+                        pos = dequeuePos.load(std::memory_order_relaxed);
+                    }
+                } while (true);
+            }
+
+        public:
+            explicit mpmc_queue(size_t capacity)
+                : mask(roundUp(capacity) - 1), enqueuePos(0), dequeuePos(0), _closed(false)
+            {
+                buffer = new cell[mask + 1];
+                for (size_t i = 0; i <= mask; i++) {
+                    buffer[i].seq.store(i, std::memory_order_relaxed);
+                }
+            }
+            mpmc_queue(const mpmc_queue&) = delete;
+            ~mpmc_queue()
+            {
+                delete[] buffer;
+            }
+
+            template <class U>
+            bool try_push(U&& v)
+            {
+                if (_closed.load(std::memory_order_acquire) || !enqueue(std::forward<U>(v))) {
+                    return false;
+                }
+                notEmpty.notify_one();
+                return true;
+            }
+
+            bool try_pop(T& v)
+            {
+                if (!dequeue(v)) {
+                    return false;
+                }
+                notFull.notify_one();
+                return true;
+            }
+
+            // blocks while the queue is full, false once it is closed
+            template <class U>
+            bool push(U&& v)
+            {
+                do {
+                    if (_closed.load(std::memory_order_acquire)) {
+                        return false;
+                    }
+                    if (enqueue(std::forward<U>(v))) {
+                        notEmpty.notify_one();
+                        return true;
+                    }
+                    auto key = notFull.prepare();
+                    if (_closed.load(std::memory_order_acquire) || size() <= mask) {
+                        notFull.cancel();
+                        continue;
+                    }
+                    notFull.wait(key);
+                } while (true);
+            }
+
+            // blocks while the queue is empty, false once it is closed and drained
+            bool pop(T& v)
+            {
+                do {
+                    if (try_pop(v)) {
+                        return true;
+                    }
+                    auto key = notEmpty.prepare();
+                    if (size() > 0) {
+                        notEmpty.cancel();
+                        continue;
+                    }
+                    if (_closed.load(std::memory_order_acquire)) {
+                        notEmpty.cancel();
+                        return try_pop(v);
+                    }
+                    notEmpty.wait(key);
+                } while (true);
+            }
+
+            void close()
+            {
+                _closed.store(true, std::memory_order_release);
+                notEmpty.notify_all();
+                notFull.notify_all();
+            }
+
+            bool closed() const
+            {
+                return _closed.load(std::memory_order_acquire);
+            }
+
+            // approximate while other threads are pushing or popping
+            size_t size() const
+            {
+                size_t e = enqueuePos.load(std::memory_order_acquire);
+                size_t d = dequeuePos.load(std::memory_order_acquire);
+                return e > d ? e - d : 0;
+            }
+
+            size_t capacity() const
+            {
+                return mask + 1;
+            }
+        };
+
+        // Hierarchical timing wheel: `levels` wheels of 64 slots, level l counting in units of
+        // 64^l ticks. schedule() and the per-tick work are O(1); an entry is moved down a level
+        // at most levels - 1 times before it fires. Delays beyond the last level are clamped.
+        // Not synchronized, callers own the locking.
+        template <class T, int levels = 4>
+        class timer_wheel
+        {
+            static const int bits = 6;
+            static const uint64_t slots = 1 << bits;
+            static const uint64_t slotMask = slots - 1;
+
+            struct entry {
+                uint64_t expiry;
+                T value;
+            };
+
+            std::vector<entry> wheel[levels][slots];
+            uint64_t current;
+            size_t count;
+
+            void insert(entry&& e)
+            {
+                uint64_t diff = e.expiry > current ? e.expiry - current : 0;
+                int level = 0;
+                while (level < levels - 1 && diff >= (uint64_t(1) << (bits * (level + 1)))) {
+                    level++;
+                }
+                uint64_t max = (uint64_t(1) << (bits * levels)) - 1;
+                if (diff > max) {
+                    e.expiry = current + max;
+                }
+                auto slot = (e.expiry >> (bits * level)) & slotMask;
+                wheel[level][slot].emplace_back(std::move(e));
+            }
+
+            // redistributes the slot of `level` that just came due into the lower levels
+            void cascade(int level)
+            {
+                auto slot = (current >> (bits * level)) & slotMask;
+                std::vector<entry> moving;
+                std::swap(moving, wheel[level][slot]);
+                for (auto& e : moving) {
+                    insert(std::move(e));
+                }
+            }
+
+        public:
+            timer_wheel(uint64_t now = 0) : current(now), count(0) {}
+
+            void schedule(T v, uint64_t delay)
+            {
+                insert(entry{current + (delay == 0 ? 1 : delay), std::move(v)});
+                count++;
+            }
+
+            // moves the wheel up to tick `now`, calling fire(T&) for every expired entry
+            template <class F>
+            size_t advance(uint64_t now, F fire)
+            {
+                size_t fired = 0;
+                while (current < now) {
+                    current++;
+                    for (int l = 1; l < levels; l++) {
+                        if ((current & ((uint64_t(1) << (bits * l)) - 1)) != 0) {
+                            break;
+                        }
+                        cascade(l);
+                    }
+                    auto& due = wheel[0][current & slotMask];
+                    if (due.size() == 0) {
+                        continue;
+                    }
+                    std::vector<entry> firing;
+                    std::swap(firing, due);
+                    for (auto& e : firing) {
+                        count--;
+                        fired++;
+                        fire(e.value);
+                    }
+                }
+                return fired;
+            }
+
+            // fires everything regardless of its expiry
+            template <class F>
+            size_t flush(F fire)
+            {
+                size_t fired = 0;
+                for (auto& level : wheel) {
+                    for (auto& slot : level) {
+                        std::vector<entry> firing;
+                        std::swap(firing, slot);
+                        for (auto& e : firing) {
+                            count--;
+                            fired++;
+                            fire(e.value);
+                        }
+                    }
+                }
+                return fired;
+            }
+
+            size_t size() const
+            {
+                return count;
+            }
+
+            uint64_t now() const
+            {
+                return current;
+            }
+        };
+
+        // Fixed pool of worker threads running submitted tasks. Every worker owns a deque:
+        // tasks submitted from a worker go to the back of its own deque and are taken from
+        // there again (LIFO keeps the data warm), idle workers steal from the front of the
+        // others. Tasks from outside the pool are spread round-robin. Idle workers sleep on an
+        // event_count. stop() waits for the tasks already queued, then joins the workers.
+        class executor
+        {
+        public:
+            using task = std::function<void()>;
+
+        private:
+            class worker : public thread
+            {
+                friend class executor;
+
+                executor& owner;
+                size_t index;
+                mutex _m;
+                std::deque<task> _q;
+
+                virtual void* start(void*, void*, void*) override
+                {
+                    current() = this;
+                    owner.run(index);
+                    return nullptr;
+                }
+
+            public:
+                worker(executor& e, size_t i) : thread("executor"), owner(e), index(i) {}
+                virtual ~worker() {}
+            };
+
+            std::vector<worker*> workers;
+            std::atomic<size_t> next;
+            // tasks sitting in some deque
+            std::atomic<long> queued;
+            std::atomic<bool> stopping;
+            event_count available;
+
+            static worker*& current()
+            {
+                thread_local worker* w = nullptr;
+                return w;
+            }
+
+            bool pop(size_t i, task& t)
+            {
+                auto w = workers[i];
+                w->_m.lock();
+                bool ret = !w->_q.empty();
+                if (ret) {
+                    t = std::move(w->_q.back());
+                    w->_q.pop_back();
+                }
+                w->_m.unlock();
+                return ret;
+            }
+
+            bool steal(size_t i, task& t)
+            {
+                for (size_t k = 1; k < workers.size(); k++) {
+                    auto w = workers[(i + k) % workers.size()];
+                    w->_m.lock();
+                    bool ret = !w->_q.empty();
+                    if (ret) {
+                        t = std::move(w->_q.front());
+                        w->_q.pop_front();
+                    }
+                    w->_m.unlock();
+                    if (ret) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            void run(size_t i)
+            {
+                task t;
+                do {
+                    if (pop(i, t) || steal(i, t)) {
+                        queued.fetch_sub(1, std::memory_order_relaxed);
+                        t();
+                        t = nullptr;
+                        continue;
+                    }
+                    auto key = available.prepare();
+                    if (queued.load(std::memory_order_seq_cst) > 0) {
+                        available.cancel();
+                        continue;
+                    }
+                    if (stopping.load(std::memory_order_acquire)) {
+                        available.cancel();
+                        break;
+                    }
+                    available.wait(key);
+                } while (true);
+            }
+
+        public:
+            explicit executor(size_t n) : next(0), queued(0), stopping(false)
+            {
+                if (n == 0) {
+                    n = 1;
+                }
+                for (size_t i = 0; i < n; i++) {
+                    workers.emplace_back(new worker(*this, i));
+                }
+                for (auto w : workers) {
+                    w->begin();
+                }
+            }
+            executor(const executor&) = delete;
+
+            ~executor()
+            {
+                stop();
+            }
+
+            void submit(task t)
+            {
+                auto self = current();
+                size_t i = self != nullptr && &self->owner == this
+                               ? self->index
+                               : next.fetch_add(1, std::memory_order_relaxed) % workers.size();
+                auto w = workers[i];
+                w->_m.lock();
+                w->_q.emplace_back(std::move(t));
+                w->_m.unlock();
+                queued.fetch_add(1, std::memory_order_seq_cst);
+                available.notify_one();
+            }
+
+            void stop()
+            {
+                if (workers.empty()) {
+                    return;
+                }
+                stopping.store(true, std::memory_order_release);
+                available.notify_all();
+                // idle workers still look into the others' queues until they see `stopping`
+                for (auto w : workers) {
+                    w->join();
+                }
+                for (auto w : workers) {
+                    delete w;
+                }
+                workers.clear();
+            }
+
+            size_t size() const
+            {
+                return workers.size();
+            }
+        };
+
+        class task_graph;
+
+        // Type independent part of a task_graph node.
+        class graph_stage
+        {
+            friend class task_graph;
+
+        protected:
+            task_graph& graph;
+            mutex _m;
+            size_t limit;
+            size_t running;
+            // stages to kick when this one finishes an item, they may be throttled by it
+            std::vector<graph_stage*> upstream;
+            // may another item be started
+            std::function<bool()> gate;
+
+            graph_stage(task_graph& g, size_t l) : graph(g), limit(l < 1 ? 1 : l), running(0) {}
+
+            void done();
+
+        public:
+            virtual ~graph_stage() {}
+            // starts backlogged items while the limit and the gate allow it
+            virtual void kick() = 0;
+            // items backlogged or running
+            virtual size_t load() = 0;
+        };
+
+        // A node of a task_graph. Items posted to a stage run through its function on the
+        // graph's executor, at most `limit` of them at a time; the others wait in the
+        // backlog. The function hands results on by posting them to the next stage. An
+        // asynchronous stage gets a completion instead and its item counts as running until
+        // that is called, from any thread. T has to be copyable, tasks are std::functions.
+        template <class T>
+        class stage : public graph_stage
+        {
+            friend class task_graph;
+
+        public:
+            using completion = std::function<void()>;
+            using asyncFn = std::function<void(T&, completion)>;
+
+        private:
+            asyncFn fn;
+            std::deque<T> backlog;
+
+            stage(task_graph& g, size_t l, asyncFn f) : graph_stage(g, l), fn(std::move(f)) {}
+
+        public:
+            void post(T v);
+
+            virtual void kick() override;
+
+            virtual size_t load() override
+            {
+                _m.lock();
+                auto ret = backlog.size() + running;
+                _m.unlock();
+                return ret;
+            }
+        };
+
+        // Pipeline of stages sharing one executor. The graph counts items from post() until
+        // the stage function returns, so wait_idle() returns once nothing is left anywhere.
+        class task_graph
+        {
+            friend class graph_stage;
+            template <class T>
+            friend class stage;
+
+            executor& ex;
+            std::vector<std::unique_ptr<graph_stage>> stages;
+            std::atomic<long> inflight;
+            event_count settled;
+
+            void finish()
+            {
+                inflight.fetch_sub(1, std::memory_order_seq_cst);
+                settled.notify_all();
+            }
+
+        public:
+            explicit task_graph(executor& e) : ex(e), inflight(0) {}
+            task_graph(const task_graph&) = delete;
+
+            template <class T>
+            stage<T>& add(size_t limit, std::function<void(T&)> fn)
+            {
+                return add_async<T>(limit, [fn](T& v, typename stage<T>::completion done) {
+                    fn(v);
+                    done();
+                });
+            }
+
+            template <class T>
+            stage<T>& add_async(size_t limit, typename stage<T>::asyncFn fn)
+            {
+                auto s = new stage<T>(*this, limit, std::move(fn));
+                stages.emplace_back(s);
+                return *s;
+            }
+
+            // `from` only starts an item while its running items plus those held by `to` stay
+            // below window(), and is kicked again whenever `to` finishes one.
+            void throttle(graph_stage& from, graph_stage& to, std::function<long()> window)
+            {
+                auto source = &from;
+                auto target = &to;
+                // evaluated by from.kick() with from's lock held
+                from.gate = [source, target, window] {
+                    return static_cast<long>(source->running + target->load()) < window();
+                };
+                to.upstream.push_back(&from);
+            }
+
+            long size() const
+            {
+                return inflight.load(std::memory_order_relaxed);
+            }
+
+            // blocks until fewer than n items are in the graph
+            void wait_below(long n)
+            {
+                do {
+                    auto key = settled.prepare();
+                    if (inflight.load(std::memory_order_seq_cst) < n) {
+                        settled.cancel();
+                        return;
+                    }
+                    settled.wait(key);
+                } while (true);
+            }
+
+            void wait_idle()
+            {
+                wait_below(1);
+            }
+
+            // as wait_below(), false once monotonic_us() reached `deadline` first
+            bool wait_below_until(long n, uint64_t deadline)
+            {
+                do {
+                    auto key = settled.prepare();
+                    if (inflight.load(std::memory_order_seq_cst) < n) {
+                        settled.cancel();
+                        return true;
+                    }
+                    auto t = monotonic_us();
+                    if (t >= deadline) {
+                        settled.cancel();
+                        return false;
+                    }
+                    settled.wait_for(key, deadline - t);
+                } while (true);
+            }
+
+            bool wait_idle_until(uint64_t deadline)
+            {
+                return wait_below_until(1, deadline);
+            }
+        };
+
+        inline void graph_stage::done()
+        {
+            _m.lock();
+            running--;
+            _m.unlock();
+            kick();
+            for (auto u : upstream) {
+                u->kick();
+            }
+            graph.finish();
+        }
+
+        template <class T>
+        void stage<T>::post(T v)
+        {
+            graph.inflight.fetch_add(1, std::memory_order_seq_cst);
+            _m.lock();
+            backlog.emplace_back(std::move(v));
+            _m.unlock();
+            kick();
+        }
+
+        template <class T>
+        void stage<T>::kick()
+        {
+            _m.lock();
+            while (running < limit && !backlog.empty() && (!gate || gate())) {
+                running++;
+                T v = std::move(backlog.front());
+                backlog.pop_front();
+                graph.ex.submit([this, v]() mutable { fn(v, [this] { done(); }); });
+            }
+            _m.unlock();
+        }
     }  // namespace thread_ns
 }  // namespace tb
 
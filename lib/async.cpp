@@ -0,0 +1,312 @@
+#include "async.h"
+#include "metrics.h"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <climits>
+#include <memory>
+
+namespace
+{
+    // owns a spawned task until it finished, both frames are freed then
+    struct detached {
+        struct promise_type {
+            detached get_return_object()
+            {
+                return {};
+            }
+            std::suspend_never initial_suspend() noexcept
+            {
+                return {};
+            }
+            std::suspend_never final_suspend() noexcept
+            {
+                return {};
+            }
+            void return_void() {}
+            void unhandled_exception()
+            {
+                std::terminate();
+            }
+        };
+    };
+
+    detached runDetached(tb::async::task<void> t)
+    {
+        co_await t;
+    }
+}  // namespace
+
+namespace tb
+{
+    namespace async
+    {
+        // event_loop
+
+        event_loop::event_loop(const char* name)
+            : thread(name),
+              epfd(epoll_create1(EPOLL_CLOEXEC)),
+              wakefd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+              running(true),
+              seq(0)
+        {
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.fd = wakefd;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+        }
+
+        event_loop::~event_loop()
+        {
+            close(wakefd);
+            close(epfd);
+        }
+
+        void event_loop::post(callback fn)
+        {
+            _m.lock();
+            posted.emplace_back(std::move(fn));
+            _m.unlock();
+            uint64_t one = 1;
+            ssize_t r = write(wakefd, &one, sizeof one);
+            (void)r;
+        }
+
+        void event_loop::spawn(task<void> t)
+        {
+            // std::function wants a copyable callable
+            auto p = std::make_shared<task<void>>(std::move(t));
+            post([p] { runDetached(std::move(*p)); });
+        }
+
+        void event_loop::stop()
+        {
+            running = false;
+            uint64_t one = 1;
+            ssize_t r = write(wakefd, &one, sizeof one);
+            (void)r;
+            join();
+        }
+
+        void event_loop::watch(int fd, uint32_t events, ioCallback fn)
+        {
+            struct epoll_event ev;
+            ev.events = events;
+            ev.data.fd = fd;
+            bool known = watchers.count(fd) > 0;
+            epoll_ctl(epfd, known ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev);
+            watchers[fd] = std::move(fn);
+        }
+
+        void event_loop::unwatch(int fd)
+        {
+            if (watchers.erase(fd) > 0) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+            }
+        }
+
+        void event_loop::after(uint64_t us, callback fn)
+        {
+            timers.push({tb::metrics::now() + us, seq++, std::move(fn)});
+        }
+
+        void event_loop::runPosted()
+        {
+            std::vector<callback> ready;
+            _m.lock();
+            std::swap(ready, posted);
+            _m.unlock();
+            for (auto& fn : ready) {
+                fn();
+            }
+        }
+
+        void event_loop::runTimers()
+        {
+            auto t = tb::metrics::now();
+            while (!timers.empty() && timers.top().deadline <= t) {
+                auto fn = timers.top().fn;
+                timers.pop();
+                fn();
+            }
+        }
+
+        int event_loop::nextTimeout()
+        {
+            _m.lock();
+            bool pending = !posted.empty();
+            _m.unlock();
+            if (pending) {
+                return 0;
+            }
+            if (timers.empty()) {
+                return -1;
+            }
+            auto t = tb::metrics::now();
+            auto deadline = timers.top().deadline;
+            if (deadline <= t) {
+                return 0;
+            }
+            uint64_t ms = (deadline - t + 999) / 1000;
+            return ms > INT_MAX ? INT_MAX : static_cast<int>(ms);
+        }
+
+        void* event_loop::start(void*, void*, void*)
+        {
+            const int batch = 64;
+            struct epoll_event events[batch];
+            while (running) {
+                runPosted();
+                runTimers();
+                int n = epoll_wait(epfd, events, batch, nextTimeout());
+                for (int i = 0; i < n; i++) {
+                    int fd = events[i].data.fd;
+                    if (fd == wakefd) {
+                        uint64_t v;
+                        ssize_t r = read(wakefd, &v, sizeof v);
+                        (void)r;
+                        continue;
+                    }
+                    auto it = watchers.find(fd);
+                    if (it == watchers.end()) {
+                        continue;
+                    }
+                    // the callback may unwatch, and so destroy, itself
+                    auto fn = it->second;
+                    fn(events[i].events);
+                }
+            }
+            return nullptr;
+        }
+
+        // event_loop END
+        // http_client
+
+        http_client::http_client(event_loop& l) : loop(l), multi(nullptr), timerGeneration(0)
+        {
+            // reference counted, the first call has to happen before other threads use curl
+            curl_global_init(CURL_GLOBAL_DEFAULT);
+            multi = curl_multi_init();
+            curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, onSocket);
+            curl_multi_setopt(multi, CURLMOPT_SOCKETDATA, this);
+            curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, onTimer);
+            curl_multi_setopt(multi, CURLMOPT_TIMERDATA, this);
+        }
+
+        http_client::~http_client()
+        {
+            curl_multi_cleanup(multi);
+            curl_global_cleanup();
+        }
+
+        int http_client::onSocket(CURL*, curl_socket_t s, int what, void* userp, void*)
+        {
+            auto c = static_cast<http_client*>(userp);
+            if (what == CURL_POLL_REMOVE) {
+                c->loop.unwatch(s);
+                return 0;
+            }
+            uint32_t events = 0;
+            if (what & CURL_POLL_IN) {
+                events |= EPOLLIN;
+            }
+            if (what & CURL_POLL_OUT) {
+                events |= EPOLLOUT;
+            }
+            c->loop.watch(s, events, [c, s](uint32_t revents) {
+                int flags = 0;
+                if (revents & EPOLLIN) {
+                    flags |= CURL_CSELECT_IN;
+                }
+                if (revents & EPOLLOUT) {
+                    flags |= CURL_CSELECT_OUT;
+                }
+                if (revents & (EPOLLERR | EPOLLHUP)) {
+                    flags |= CURL_CSELECT_ERR;
+                }
+                c->action(s, flags);
+            });
+            return 0;
+        }
+
+        int http_client::onTimer(CURLM*, long ms, void* userp)
+        {
+            auto c = static_cast<http_client*>(userp);
+            auto generation = ++c->timerGeneration;
+            if (ms < 0) {
+                return 0;
+            }
+            // curl must not be re-entered from its own callback, the loop calls back later
+            c->loop.after(ms * 1000, [c, generation] {
+                if (generation == c->timerGeneration) {
+                    c->action(CURL_SOCKET_TIMEOUT, 0);
+                }
+            });
+            return 0;
+        }
+
+        size_t http_client::onData(char* data, size_t size, size_t n, void* userp)
+        {
+            static_cast<std::string*>(userp)->append(data, size * n);
+            return size * n;
+        }
+
+        void http_client::action(curl_socket_t s, int flags)
+        {
+            int running;
+            curl_multi_socket_action(multi, s, flags, &running);
+            collect();
+        }
+
+        void http_client::collect()
+        {
+            std::vector<transfer*> done;
+            CURLMsg* msg;
+            int left;
+            while ((msg = curl_multi_info_read(multi, &left)) != nullptr) {
+                if (msg->msg != CURLMSG_DONE) {
+                    continue;
+                }
+                char* p = nullptr;
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &p);
+                auto t = reinterpret_cast<transfer*>(p);
+                t->result = msg->data.result;
+                done.push_back(t);
+            }
+            // resumed requests may start new transfers, so the handles go first
+            for (auto t : done) {
+                curl_multi_remove_handle(multi, t->easy);
+            }
+            for (auto t : done) {
+                t->waiter.resume();
+            }
+        }
+
+        task<long> http_client::post(std::string url,
+                                     std::string body,
+                                     std::string& response,
+                                     CURLcode& code,
+                                     long timeoutMs)
+        {
+            CURL* easy = curl_easy_init();
+            response.clear();
+            curl_easy_setopt(easy, CURLOPT_URL, url.c_str());
+            curl_easy_setopt(easy, CURLOPT_POST, 1L);
+            curl_easy_setopt(easy, CURLOPT_POSTFIELDS, body.c_str());
+            curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE, static_cast<long>(body.size()));
+            curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, onData);
+            curl_easy_setopt(easy, CURLOPT_WRITEDATA, &response);
+            curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, timeoutMs);
+            curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+            code = co_await perform(easy);
+            long status = 0;
+            if (code == CURLE_OK) {
+                curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
+            }
+            curl_easy_cleanup(easy);
+            co_return status;
+        }
+
+        // http_client END
+    }  // namespace async
+}  // namespace tb
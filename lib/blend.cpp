@@ -0,0 +1,134 @@
+#include "blend.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TB_BLEND_X86 1
+#endif
+
+namespace
+{
+    // rounded v / 255 for v <= 255 * 255
+    inline unsigned int div255(unsigned int v)
+    {
+        v += 128;
+        return (v + (v >> 8)) >> 8;
+    }
+
+    void overlayScalar(uint8_t* dst, const uint8_t* p, const uint8_t* a, size_t n)
+    {
+        for (size_t i = 0; i < n; i++) {
+            unsigned int v = div255(dst[i] * a[i]) + p[i];
+            dst[i] = v > 255 ? 255 : v;
+        }
+    }
+
+#ifdef TB_BLEND_X86
+    __attribute__((target("sse4.1"))) inline __m128i div255(__m128i v)
+    {
+        v = _mm_add_epi16(v, _mm_set1_epi16(128));
+        return _mm_srli_epi16(_mm_add_epi16(v, _mm_srli_epi16(v, 8)), 8);
+    }
+
+    __attribute__((target("sse4.1"))) void overlaySSE41(uint8_t* dst,
+                                                         const uint8_t* p,
+                                                         const uint8_t* a,
+                                                         size_t n)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+            __m128i inv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+            __m128i lo = _mm_mullo_epi16(_mm_cvtepu8_epi16(d), _mm_cvtepu8_epi16(inv));
+            __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(inv, zero));
+            __m128i r = _mm_packus_epi16(div255(lo), div255(hi));
+            r = _mm_adds_epu8(r, _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), r);
+        }
+        overlayScalar(dst + i, p + i, a + i, n - i);
+    }
+
+    __attribute__((target("avx2"))) inline __m256i div255(__m256i v)
+    {
+        v = _mm256_add_epi16(v, _mm256_set1_epi16(128));
+        return _mm256_srli_epi16(_mm256_add_epi16(v, _mm256_srli_epi16(v, 8)), 8);
+    }
+
+    __attribute__((target("avx2"))) void overlayAVX2(uint8_t* dst,
+                                                      const uint8_t* p,
+                                                      const uint8_t* a,
+                                                      size_t n)
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        size_t i = 0;
+        for (; i + 32 <= n; i += 32) {
+            __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+            __m256i inv = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+            // unpack and pack both work per 128 bit lane, so the byte order survives
+            __m256i lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero),
+                                            _mm256_unpacklo_epi8(inv, zero));
+            __m256i hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero),
+                                            _mm256_unpackhi_epi8(inv, zero));
+            __m256i r = _mm256_packus_epi16(div255(lo), div255(hi));
+            r = _mm256_adds_epu8(r, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i)));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), r);
+        }
+        overlaySSE41(dst + i, p + i, a + i, n - i);
+    }
+#endif
+
+    struct Kernel {
+        const char* name;
+        tb::blend::kernel fn;
+        bool (*supported)();
+    };
+
+    const Kernel kernels[] = {
+#ifdef TB_BLEND_X86
+        {"avx2", overlayAVX2, [] { return __builtin_cpu_supports("avx2") != 0; }},
+        {"sse4.1", overlaySSE41, [] { return __builtin_cpu_supports("sse4.1") != 0; }},
+#endif
+        {"scalar", overlayScalar, [] { return true; }},
+    };
+
+    const Kernel& best()
+    {
+        static const Kernel* k = [] {
+            for (auto& c : kernels) {
+                if (c.supported()) {
+                    return &c;
+                }
+            }
+            return &kernels[0];
+        }();
+        return *k;
+    }
+}  // namespace
+
+namespace tb
+{
+    namespace blend
+    {
+        void overlay(uint8_t* dst, const uint8_t* premultiplied, const uint8_t* inverse, size_t n)
+        {
+            best().fn(dst, premultiplied, inverse, n);
+        }
+
+        kernel find(const char* name)
+        {
+            for (auto& c : kernels) {
+                if (strcmp(c.name, name) == 0) {
+                    return c.supported() ? c.fn : nullptr;
+                }
+            }
+            return nullptr;
+        }
+
+        const char* implementation()
+        {
+            return best().name;
+        }
+    }  // namespace blend
+}  // namespace tb
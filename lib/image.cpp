@@ -1,13 +1,17 @@
 
 #include "image.h"
+#include "blend.h"
 #include "id.h"
+#include "metrics.h"
 #include "ocr.h"
 #include "taobao.h"
 
 #include <json/json.h>
 #include <unistd.h>
 #include <zbar.h>
+#include <algorithm>
 #include <iostream>
+#include <memory>
 #include <vector>
 
 #define ENABLE_SHOW
@@ -25,85 +29,201 @@
 
 namespace
 {
-    aip::Ocr* client;
+    // aip::Ocr is not safe to share, so every OCR thread builds its own client from these
+    bool ocrEnabled = false;
+    std::string ocrAppId, ocrApiKey, ocrSecretKey;
 
-    int opencvFindBarCodeROI(const cv::Mat mat,
-                             cv::Rect& roi,
-                             unsigned dilateTimes = 4,
-                             cv::Size elmentSize = cv::Size(7, 7))
+    aip::Ocr* localClient()
     {
-        using namespace cv;
-        using std::vector;
-
-        int height = mat.rows;
-        int cuttedHeight = height * 0.4;
-        Mat imageGussian;
-        Mat imageSobelX, imageSobelY, imageSobelOut;
-        Mat raw;
-        mat.copyTo(raw);
-        Mat img = raw(cv::Range(cuttedHeight, height), cv::Range::all());
-        cvtColor(img, img, CV_RGB2GRAY);
-        GaussianBlur(img, imageGussian, cv::Size(3, 3), 0);
-        Mat imageX16S, imageY16S;
-        Sobel(imageGussian, imageX16S, CV_16S, 1, 0, 3, 1, 0, 4);
-        Sobel(imageGussian, imageY16S, CV_16S, 0, 1, 3, 1, 0, 4);
-        convertScaleAbs(imageX16S, imageSobelX, 1, 0);
-        convertScaleAbs(imageY16S, imageSobelY, 1, 0);
-        imageSobelOut = imageSobelX - imageSobelY;
-        blur(imageSobelOut, imageSobelOut, cv::Size(3, 3));
-        Mat imageSobleOutThreshold;
-        threshold(imageSobelOut, imageSobleOutThreshold, 170, 255, CV_THRESH_BINARY);
-        Mat element = getStructuringElement(0, elmentSize);
-        morphologyEx(imageSobleOutThreshold, imageSobleOutThreshold, cv::MORPH_CLOSE, element);
-        erode(imageSobleOutThreshold, imageSobleOutThreshold, element);
-        for (unsigned i = 0; i < dilateTimes; i++) {
-            dilate(imageSobleOutThreshold, imageSobleOutThreshold, element);
-        }
-        vector<vector<cv::Point>> contours;
-        vector<cv::Vec4i> hiera;
-        findContours(
-            imageSobleOutThreshold, contours, hiera, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_NONE);
-        Rect&& rect = cv::Rect(0, 0, 0, 0);
-        for (auto& r : contours) {
-            auto t = cv::boundingRect((Mat)r);
-            if (rect.area() < t.area()) {
-                rect = t;
-            }
+        thread_local std::unique_ptr<aip::Ocr> client;
+        if (client == nullptr && ocrEnabled) {
+            client.reset(new aip::Ocr(ocrAppId, ocrApiKey, ocrSecretKey));
         }
-        if (rect.height > rect.width) {
-            return -1;
-        } else {
-            roi = Rect(rect.x, rect.y + cuttedHeight, rect.width, rect.height);
-            return 0;
+        return client.get();
+    }
+
+    // Reads the frame size from the SOFn segment of a JPEG file without decoding it.
+    bool jpegFrameSize(const char* fname, int& width, int& height)
+    {
+        FILE* fp = fopen(fname, "rb");
+        if (fp == nullptr) {
+            return false;
+        }
+        bool ret = false;
+        unsigned char b[8];
+        if (fread(b, 1, 2, fp) == 2 && b[0] == 0xFF && b[1] == 0xD8) {
+            do {
+                int c = fgetc(fp);
+                if (c != 0xFF) {
+                    break;
+                }
+                do {
+                    c = fgetc(fp);
+                } while (c == 0xFF);
+                if (c == EOF || c == 0xD9 || c == 0xDA) {
+                    break;
+                }
+                if (c == 0x01 || (c >= 0xD0 && c <= 0xD7)) {
+                    continue;
+                }
+                if (fread(b, 1, 2, fp) != 2) {
+                    break;
+                }
+                long length = (b[0] << 8) | b[1];
+                if (length < 2) {
+                    break;
+                }
+                if (c >= 0xC0 && c <= 0xCF && c != 0xC4 && c != 0xC8 && c != 0xCC) {
+                    // precision, height, width
+                    if (fread(b, 1, 5, fp) == 5) {
+                        height = (b[1] << 8) | b[2];
+                        width = (b[3] << 8) | b[4];
+                        ret = width > 0 && height > 0;
+                    }
+                    break;
+                }
+                if (fseek(fp, length - 2, SEEK_CUR) != 0) {
+                    break;
+                }
+            } while (true);
+        }
+        fclose(fp);
+        return ret;
+    }
+
+    // Picks the largest IMREAD_REDUCED_COLOR_N whose output is still at least `width` wide.
+    // The shorter side is used because EXIF orientation may swap the axes after decoding.
+    int reducedDecodeFlags(const char* fname, int width)
+    {
+        int w = 0, h = 0;
+        if (!jpegFrameSize(fname, w, h)) {
+            return cv::IMREAD_COLOR;
         }
+        int side = std::min(w, h);
+        if (side >= width * 8) {
+            return cv::IMREAD_REDUCED_COLOR_8;
+        }
+        if (side >= width * 4) {
+            return cv::IMREAD_REDUCED_COLOR_4;
+        }
+        if (side >= width * 2) {
+            return cv::IMREAD_REDUCED_COLOR_2;
+        }
+        return cv::IMREAD_COLOR;
     }
 
-    // identify bar code via zbar
-    int zbarCodeIdentify(const cv::Mat& raw, const cv::Rect& roi, std::string& bcode)
+    // intermediate images of the bar code detector, kept per thread so a board of the same
+    // size as the last one allocates nothing
+    struct RoiBuffers {
+        cv::Mat small, gray, blurred, x16, y16, x, y, edges;
+        cv::Mat element;
+        int elementSide = 0;
+        std::vector<std::vector<cv::Point>> contours;
+    };
+
+    RoiBuffers& roiBuffers()
+    {
+        thread_local RoiBuffers b;
+        return b;
+    }
+
+    // One scanner per thread, only the linear codes our tags print: 13 characters of digits
+    // and capitals (see only::checkBarCodeValidate), which is Code 128 or Code 39.
+    struct BarCodeScanner {
+        zbar::ImageScanner scanner;
+        cv::Mat gray, binary, large, stretched, turned;
+
+        BarCodeScanner()
+        {
+            scanner.set_config(zbar::ZBAR_NONE, zbar::ZBAR_CFG_ENABLE, 0);
+            scanner.set_config(zbar::ZBAR_CODE128, zbar::ZBAR_CFG_ENABLE, 1);
+            scanner.set_config(zbar::ZBAR_CODE39, zbar::ZBAR_CFG_ENABLE, 1);
+        }
+
+        // 1 on a well formed code, 2 if only something else was read, 0 on nothing, -1 on a
+        // zbar error. A well formed code wins over whatever was read first.
+        int scan(const cv::Mat& m, std::string& bcode)
+        {
+            zbar::Image img(m.cols, m.rows, "Y800", m.data, m.total());
+            int n = scanner.scan(img);
+            if (n <= 0) {
+                return n;
+            }
+            int ret = 0;
+            for (auto s = img.symbol_begin(); s != img.symbol_end(); ++s) {
+                std::string data = s->get_data();
+                if (only::checkBarCodeValidate(data)) {
+                    bcode = data;
+                    return 1;
+                }
+                if (ret == 0) {
+                    bcode = data;
+                    ret = 2;
+                }
+            }
+            return ret;
+        }
+    };
+
+    BarCodeScanner& barCodeScanner()
+    {
+        thread_local BarCodeScanner s;
+        return s;
+    }
+
+    // Identifies the bar code in `roi` via zbar. The cheap binarized scan goes first, a miss
+    // climbs the ladder unless `ladder` is off: twice the size, contrast stretched grey,
+    // turned by 180°.
+    int zbarCodeIdentify(const cv::Mat& raw,
+                         const cv::Rect& roi,
+                         std::string& bcode,
+                         bool ladder = true)
     {
         using namespace cv;
-        using namespace zbar;
 
-        ImageScanner scanner;
-        Mat gray;
+        if (roi.area() == 0) {
+            return 0;
+        }
+        auto& z = barCodeScanner();
         Mat mat = raw(roi);
         Mat barImg = mat(Range(0.1 * mat.rows, mat.rows), Range::all());
-        //resize(barImg, barImg, Size(barImg.cols, 3 * barImg.rows));
-        cvtColor(barImg, gray, COLOR_RGB2GRAY);
-        scanner.set_config(ZBAR_NONE, ZBAR_CFG_ENABLE, 1);
-        zbar::Image zbimg(gray.cols, gray.rows, "Y800", gray.data, gray.rows * gray.cols);
-        int n = scanner.scan(zbimg);
-        if (n > 0) {
-            auto results = scanner.get_results();
-            assert(results.get_size() == 1);
-            auto begin = results.symbol_begin();
-            bcode = begin->get_data();
+        cvtColor(barImg, z.gray, COLOR_BGR2GRAY);
+
+        std::string found;
+        int ret = 0;
+        // stops at the first well formed code, otherwise keeps the first thing read
+        auto attempt = [&](const Mat& m) {
+            std::string c;
+            int r = z.scan(m, c);
+            if (r == 1 || (r == 2 && ret <= 0)) {
+                found = c;
+                ret = r;
+            } else if (r < 0 && ret == 0) {
+                ret = -1;
+            }
+            return r == 1;
+        };
+
+        threshold(z.gray, z.binary, 0, 255, THRESH_BINARY | THRESH_OTSU);
+        bool done = attempt(z.binary) || !ladder;
+        if (!done) {
+            resize(z.gray, z.large, Size(), 2, 2, INTER_CUBIC);
+            threshold(z.large, z.large, 0, 255, THRESH_BINARY | THRESH_OTSU);
+            done = attempt(z.large);
+        }
+        if (!done) {
+            normalize(z.gray, z.stretched, 0, 255, NORM_MINMAX);
+            done = attempt(z.stretched);
+        }
+        if (!done) {
+            flip(z.stretched, z.turned, -1);
+            attempt(z.turned);
+        }
+        if (ret > 0) {
+            bcode = found;
             return 1;
-        } else if (n < 0) {
-            return -1;
-        } else {
-            return 0;
         }
+        return ret;
     }
 
 }  // namespace
@@ -134,11 +254,27 @@ namespace fc
 {
     std::vector<WaterMarker*> WaterMarker::markers;
 
-    BaseImage::BaseImage(const char* _path, unsigned int mask) : filename(_path)
+    BaseImage::BaseImage(const char* _path, unsigned int _mask, bool deferred)
+        : filename(_path), mask(_mask), decodeWidth(0)
+    {
+        if (!deferred) {
+            load();
+        }
+    }
+
+    bool BaseImage::load()
     {
         _l.write();
-        imageMat = cv::imread(filename, mask);
+        if (imageMat.empty()) {
+            int flags = mask;
+            if (decodeWidth > 0 && mask == cv::IMREAD_COLOR) {
+                flags = reducedDecodeFlags(filename.c_str(), decodeWidth);
+            }
+            imageMat = cv::imread(filename, flags);
+        }
+        bool ret = !imageMat.empty();
         _l.unlock();
+        return ret;
     }
 
     void BaseImage::resize(const cv::Size& s)
@@ -171,6 +307,11 @@ namespace fc
 
     Image::Image(const char* _fname) : BaseImage(_fname), success(true) {}
 
+    Image::Image(const char* _fname, bool deferred)
+        : BaseImage(_fname, cv::IMREAD_COLOR, deferred), success(true)
+    {
+    }
+
     int Image::getItemAccurateCode(string& bc, string& fc, int& p, int& c, OcrResult& res)
     {
         int ret = ProcessingOCR(filename, res, c, true);
@@ -189,13 +330,81 @@ namespace fc
         return ret;
     }
 
-    int Image::getBarCode(std::string& bcode, int* roi)
+    int findBarCodeROI(const cv::Mat& board, cv::Rect& roi, int detectWidth)
+    {
+        using namespace cv;
+
+        if (board.empty()) {
+            return -1;
+        }
+        // the bar code sits in the bottom 60%, a view is enough
+        int cuttedHeight = board.rows * 0.4;
+        const Mat strip = board(Range(cuttedHeight, board.rows), Range::all());
+        auto& b = roiBuffers();
+
+        // a whole factor keeps the 3×3 kernels close to what they see at full resolution
+        int factor = detectWidth > 0 ? std::max(1, strip.cols / detectWidth) : 1;
+        const Mat* src = &strip;
+        if (factor > 1) {
+            resize(strip,
+                   b.small,
+                   Size(strip.cols / factor, strip.rows / factor),
+                   0,
+                   0,
+                   INTER_AREA);
+            src = &b.small;
+        }
+        // the detector was tuned with the channels swapped, keep its weights
+        cvtColor(*src, b.gray, COLOR_RGB2GRAY);
+        GaussianBlur(b.gray, b.blurred, Size(3, 3), 0);
+        Sobel(b.blurred, b.x16, CV_16S, 1, 0, 3, 1, 0, BORDER_DEFAULT);
+        Sobel(b.blurred, b.y16, CV_16S, 0, 1, 3, 1, 0, BORDER_DEFAULT);
+        convertScaleAbs(b.x16, b.x, 1, 0);
+        convertScaleAbs(b.y16, b.y, 1, 0);
+        // vertical bars: strong horizontal gradient, weak vertical one
+        subtract(b.x, b.y, b.edges);
+        blur(b.edges, b.edges, Size(3, 3));
+        threshold(b.edges, b.edges, 170, 255, THRESH_BINARY);
+
+        // 7×7 at full resolution, scaled down with the picture but never below 3×3
+        int side = std::max(3, ((7 + factor / 2) / factor) | 1);
+        if (side != b.elementSide) {
+            b.element = getStructuringElement(MORPH_RECT, Size(side, side));
+            b.elementSide = side;
+        }
+        morphologyEx(b.edges, b.edges, MORPH_CLOSE, b.element);
+        erode(b.edges, b.edges, b.element);
+        dilate(b.edges, b.edges, b.element, Point(-1, -1), 4);
+
+        findContours(b.edges, b.contours, RETR_EXTERNAL, CHAIN_APPROX_SIMPLE);
+        Rect rect(0, 0, 0, 0);
+        for (auto& c : b.contours) {
+            auto t = boundingRect(c);
+            if (rect.area() < t.area()) {
+                rect = t;
+            }
+        }
+        if (rect.area() == 0 || rect.height > rect.width) {
+            return -1;
+        }
+        double sx = static_cast<double>(strip.cols) / src->cols;
+        double sy = static_cast<double>(strip.rows) / src->rows;
+        Rect full(std::floor(rect.x * sx),
+                  std::floor(rect.y * sy),
+                  std::ceil(rect.width * sx),
+                  std::ceil(rect.height * sy));
+        full &= Rect(0, 0, strip.cols, strip.rows);
+        roi = Rect(full.x, full.y + cuttedHeight, full.width, full.height);
+        return 0;
+    }
+
+    int Image::getBarCode(std::string& bcode, int* roi, int detectWidth)
     {
         if (roi != nullptr) {
             memset(roi, 0, 4 * sizeof(int));
         }
         cv::Rect rect;
-        int ret = opencvFindBarCodeROI(imageMat, rect);
+        int ret = findBarCodeROI(imageMat, rect, detectWidth);
         if (ret == -1) {
             return 0;
         }
@@ -208,6 +417,16 @@ namespace fc
         return zbarCodeIdentify(imageMat, rect, bcode);
     }
 
+    int Image::readBarCode(std::string& bcode, const int* window)
+    {
+        // the tag moves a little on the rig from one board to the next
+        int dx = window[2] / 8;
+        int dy = window[3] / 4;
+        cv::Rect rect(window[0] - dx, window[1] - dy, window[2] + 2 * dx, window[3] + 2 * dy);
+        rect &= cv::Rect(0, 0, imageMat.cols, imageMat.rows);
+        return zbarCodeIdentify(imageMat, rect, bcode, false);
+    }
+
     int Image::getItemCode(std::string& fcode,
                            std::string& bcode,
                            int& price,
@@ -270,19 +489,33 @@ namespace fc
 
     void Image::resizeToWidth(int width)
     {
+        _l.write();
         int currentWidth = imageMat.cols;
-        double scale = width / currentWidth;
-        if (scale - 1.0 < 1e-5) {
+        if (width <= 0 || currentWidth == 0 || currentWidth == width) {
+            _l.unlock();
             return;
         }
-        int type = CV_INTER_LINEAR;
-        if (scale < 1) {
-            type = CV_INTER_AREA;
-        } else {
-            type = CV_INTER_CUBIC;
+        int height = std::max(1, static_cast<int>(std::lround(
+                                     static_cast<double>(imageMat.rows) * width / currentWidth)));
+        if (width > currentWidth) {
+            cv::resize(imageMat, imageMat, cv::Size(width, height), 0, 0, CV_INTER_CUBIC);
+            _l.unlock();
+            return;
         }
-
-        cv::resize(imageMat, imageMat, cv::Size(), scale, scale, type);
+        // exact halvings take OpenCV's integer area fast path, only the last step is
+        // a fractional area average
+        while (imageMat.cols >= 2 * width) {
+            cv::resize(imageMat,
+                       imageMat,
+                       cv::Size(imageMat.cols / 2, imageMat.rows / 2),
+                       0,
+                       0,
+                       CV_INTER_AREA);
+        }
+        if (imageMat.cols != width) {
+            cv::resize(imageMat, imageMat, cv::Size(width, height), 0, 0, CV_INTER_AREA);
+        }
+        _l.unlock();
     }
 
     int Image::WriteToFile(const char* filename, const vector<int>& param)
@@ -292,6 +525,27 @@ namespace fc
         return imwrite(filename, imageMat, param);
     }
 
+    void BaseImage::release()
+    {
+        _l.write();
+        imageMat.release();
+        _l.unlock();
+    }
+
+    bool Image::encode(const tb::jpeg::options& o, std::vector<uint8_t>& out)
+    {
+        read();
+        bool ret = imageMat.type() == CV_8UC3
+                   && tb::jpeg::encode(imageMat.ptr<uint8_t>(0),
+                                       imageMat.cols,
+                                       imageMat.rows,
+                                       imageMat.step[0],
+                                       o,
+                                       out);
+        unlock();
+        return ret;
+    }
+
     char* OcrResult::dumpJson() const
     {
         unsigned char* gzCompressed;
@@ -466,43 +720,49 @@ namespace fc
 
         _lock.write();
         waterMarker->resize(resize);
-        //buildMask();
-        //buildSmall();
+        buildOverlays();
         _lock.unlock();
         return true;
     }
 
-    void WaterMarker::buildSmall()
+    void WaterMarker::buildOverlays()
     {
-        // Mat *smallWM = new Mat;
-        // Mat * smallMask = new Mat;
-        // auto wm = waterMarker->getMat();
-        // auto wmask = waterMarkerMask;
-        // Mat outWM, outMask;
-        // cv::resize(wm, outWM, cv::Size(0.7 * wm.cols, 0.7 * wm.rows));
-        // cv::resize(wmask, outMask, cv::Size(0.7 * wm.cols, 0.7 * wm.rows));
-        // swap(*smallWM, outWM);
-        // swap(*smallMask, outMask);
-        // small = std::make_tuple(smallWM, smallMask);
-    }
-
-    void WaterMarker::buildMask()
-    {
-        auto& wm = waterMarker->getMat();
-        waterMarkerMask = wm.clone();
-        Mat mid;
-        cv::cvtColor(waterMarkerMask, mid, CV_RGB2GRAY);
-        cv::threshold(mid, waterMarkerMask, 180, 255, CV_THRESH_BINARY_INV);
-        if (transparent < 1) {
-            Mat color_mask;
+        const double smallScale = 0.7;
+        const Mat& wm = waterMarker->getMat();
+        if (wm.empty()) {
+            return;
+        }
+        Mat bgr, alpha;
+        if (wm.channels() == 4) {
             std::vector<Mat> planes;
             split(wm, planes);
-            for (auto& it : planes) {
-                waterMarkerMask.copyTo(it);
+            alpha = planes[3];
+            planes.pop_back();
+            merge(planes, bgr);
+        } else {
+            // no alpha channel, the whole marker is opaque up to `transparent`
+            if (wm.channels() == 1) {
+                cv::cvtColor(wm, bgr, cv::COLOR_GRAY2BGR);
+            } else {
+                bgr = wm;
             }
-            merge(planes, color_mask);
-            cv::bitwise_and(wm, color_mask, waterMarkerMask);
+            alpha = Mat(wm.size(), CV_8UC1, cv::Scalar(255));
         }
+        Mat weight, colour;
+        alpha.convertTo(weight, CV_32F, transparent / 255.0);
+        merge(std::vector<Mat>{weight, weight, weight}, weight);
+        bgr.convertTo(colour, CV_32FC3);
+        colour = colour.mul(weight);
+        colour.convertTo(overlays[0].premultiplied, CV_8UC3);
+        weight.convertTo(overlays[0].inverseAlpha, CV_8UC3, -255.0, 255.0);
+
+        // shrinking the premultiplied planes keeps transparent pixels from bleeding in
+        cv::Size s(smallScale * wm.cols, smallScale * wm.rows);
+        Mat smallColour, smallWeight;
+        cv::resize(colour, smallColour, s, 0, 0, cv::INTER_AREA);
+        cv::resize(weight, smallWeight, s, 0, 0, cv::INTER_AREA);
+        smallColour.convertTo(overlays[1].premultiplied, CV_8UC3);
+        smallWeight.convertTo(overlays[1].inverseAlpha, CV_8UC3, -255.0, 255.0);
     }
 
     WaterMarker::~WaterMarker()
@@ -588,6 +848,19 @@ namespace fc
         }
         if (image.isMember("ocr")) {
             auto ocr = image["ocr"];
+            if (ocr.isObject()) {
+                double qps = ocr.isMember("qps") ? ocr["qps"].asDouble() : 10;
+                double minQps = ocr.isMember("minQps") ? ocr["minQps"].asDouble() : 0.5;
+                double step = ocr.isMember("qpsStep") ? ocr["qpsStep"].asDouble() : 1;
+                OcrLimiter::getLimiter().configure(qps, minQps, step);
+                snprintf(buffer,
+                         bufferSize,
+                         "\tOCR rate limit: %.2f/s, floor %.2f/s, additive step %.2f",
+                         qps,
+                         minQps,
+                         step);
+                log_INFO(buffer);
+            }
             if (ocr.isObject() && ocr.isMember("BaiduOCR")) {
                 auto baiduOCR = ocr["BaiduOCR"];
                 bool enable = false;
@@ -612,12 +885,84 @@ namespace fc
 
     int ImageProcessingStartup(const string& _aid, const string& _akey, const string& _skey)
     {
-        if (client == nullptr) {
-            client = new aip::Ocr(_aid, _akey, _skey);
-        }
+        ocrAppId = _aid;
+        ocrApiKey = _akey;
+        ocrSecretKey = _skey;
+        ocrEnabled = true;
         return 0;
     }
 
+    namespace
+    {
+        const char* ocrTokenUrl = "https://aip.baidubce.com/oauth/2.0/token";
+        const char* ocrUrl = "https://aip.baidubce.com/rest/2.0/ocr/v1/";
+
+        // the OCR response handling shared by the blocking and the asynchronous client
+        int parseResult(const Json::Value& result,
+                        std::vector<std::string>& vstring,
+                        uint64_t& _id,
+                        std::string& _errmessage,
+                        int& _errcode,
+                        std::string& json,
+                        int& curl)
+        {
+            auto& limiter = OcrLimiter::getLimiter();
+            vstring.clear();
+            if (result.isMember("curl_error_code")) {
+                curl = result["curl_error_code"].asInt();
+                _errcode = 1;
+                _errmessage = ocrErrorTable.at(_errcode);
+                return -1;
+            }
+
+            if (result.isMember("error_code")) {
+                _errcode = result["error_code"].asInt();
+                if (result.isMember("error_msg")) {
+                    _errmessage = result["error_msg"].asString();
+                } else {
+                    _errmessage = ocrErrorTable.at(_errcode);
+                }
+                return limiter.report(_errcode) ? OCR_THROTTLED : -1;
+            }
+            limiter.report(0);
+
+            if (result.isMember("log_id")) {
+                _id = result["log_id"].asUInt64();
+            }
+            if (result.isMember("words_result_num")) {
+                vstring.reserve(result["words_result_num"].asUInt());
+            }
+            if (result.isMember("words_result") && result["words_result"].isArray()) {
+                auto results = result["words_result"];
+                for (decltype(results.size()) i = 0; i < results.size(); i++) {
+                    vstring.emplace_back(results[i]["words"].asString());
+                }
+            }
+            Json::StreamWriterBuilder fwriter;
+            fwriter.settings_["indentation"] = "";
+            json.clear();
+            json = Json::writeString(fwriter, result);
+            return vstring.size();
+        }
+
+        string formEscape(const string& s)
+        {
+            static const char hex[] = "0123456789ABCDEF";
+            string ret;
+            ret.reserve(s.size() + s.size() / 16);
+            for (unsigned char c : s) {
+                if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+                    ret.push_back(c);
+                } else {
+                    ret.push_back('%');
+                    ret.push_back(hex[c >> 4]);
+                    ret.push_back(hex[c & 15]);
+                }
+            }
+            return ret;
+        }
+    }  // namespace
+
     int ProcessingOCR(const string& path, OcrResult& result, int& c, bool ac)
     {
         return ProcessingOCR(
@@ -637,7 +982,14 @@ namespace fc
         auto path = _path.c_str();
         Json::Value result;
         std::string image;
-        if (access(path, R_OK) != 0) {
+        auto client = localClient();
+        if (client == nullptr || access(path, R_OK) != 0) {
+            return -1;
+        }
+        auto& limiter = OcrLimiter::getLimiter();
+        if (!limiter.acquire()) {
+            _errcode = 1;
+            _errmessage = "OCR limiter stopped";
             return -1;
         }
         aip::get_file_content(path, &image);
@@ -650,42 +1002,130 @@ namespace fc
         } else {
             result = client->accurate_basic(image, options);
         }
-        vstring.clear();
-        if (result.isMember("curl_error_code")) {
-            curl = result["curl_error_code"].asInt();
-            _errcode = 1;
-            _errmessage = ocrErrorTable.at(_errcode);
-            return -1;
-        }
+        return parseResult(result, vstring, _id, _errmessage, _errcode, json, curl);
+    }  // namespace fc
 
-        if (result.isMember("error_code")) {
-            _errcode = result["error_code"].asInt();
-            if (result.isMember("error_msg")) {
-                _errmessage = result["error_msg"].asString();
-            } else {
-                _errmessage = ocrErrorTable.at(_errcode);
-            }
-            return -1;
+    // OcrClient
+
+    OcrClient::OcrClient(tb::async::http_client& _http)
+        : http(_http), tokenExpiry(0), refreshing(false)
+    {
+    }
+
+    bool OcrClient::buildRequest(const string& path, string& body)
+    {
+        if (access(path.c_str(), R_OK) != 0) {
+            return false;
         }
+        std::string image;
+        aip::get_file_content(path.c_str(), &image);
+        body = "image=" + formEscape(aip::base64_encode(image.c_str(), image.size()))
+               + "&language_type=CHN_ENG&detect_direction=true&detect_language=true"
+                 "&probability=true";
+        return true;
+    }
 
-        if (result.isMember("log_id")) {
-            _id = result["log_id"].asUInt64();
+    tb::async::task<bool> OcrClient::refreshToken()
+    {
+        auto& loop = http.getLoop();
+        while (refreshing) {
+            // another request is fetching it already
+            co_await loop.sleep(10000);
+        }
+        if (token != "" && tb::metrics::now() < tokenExpiry) {
+            co_return true;
+        }
+        refreshing = true;
+        token = "";
+        string response;
+        CURLcode code;
+        long status = co_await http.post(ocrTokenUrl,
+                                         "grant_type=client_credentials&client_id="
+                                             + formEscape(ocrApiKey)
+                                             + "&client_secret=" + formEscape(ocrSecretKey),
+                                         response,
+                                         code);
+        Json::Value v;
+        Json::CharReaderBuilder builder;
+        std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+        if (code == CURLE_OK
+            && reader->parse(response.data(), response.data() + response.size(), &v, nullptr)
+            && v.isMember("access_token")) {
+            token = v["access_token"].asString();
+            // renew a minute early, the default lifetime is 30 days
+            int64_t life = v.isMember("expires_in") ? v["expires_in"].asInt64() : 86400;
+            tokenExpiry = tb::metrics::now() + std::max<int64_t>(life - 60, 60) * 1000000;
+        } else {
+            char buffer[256];
+            snprintf(buffer,
+                     256,
+                     "Fetching the OCR access token failed, curl %d, HTTP %ld",
+                     static_cast<int>(code),
+                     status);
+            log_ERROR(buffer);
         }
-        if (result.isMember("words_result_num")) {
-            vstring.reserve(result["words_result_num"].asUInt());
+        refreshing = false;
+        co_return token != "";
+    }
+
+    tb::async::task<int> OcrClient::recognize(string body, OcrResult& r, int& curl, bool ac)
+    {
+        curl = 0;
+        if (!ocrEnabled) {
+            co_return -1;
         }
-        if (result.isMember("words_result") && result["words_result"].isArray()) {
-            auto results = result["words_result"];
-            for (decltype(results.size()) i = 0; i < results.size(); i++) {
-                vstring.emplace_back(results[i]["words"].asString());
+        auto& loop = http.getLoop();
+        auto& limiter = OcrLimiter::getLimiter();
+        do {
+            auto wait = limiter.tryAcquire();
+            if (wait == 0) {
+                break;
             }
+            if (wait < 0) {
+                r.errCode = 1;
+                r.errMessage = "OCR limiter stopped";
+                co_return -1;
+            }
+            // a paused limiter is polled, so stop() is noticed soon
+            co_await loop.sleep(std::min<int64_t>(wait, 100000));
+        } while (true);
+
+        Json::Value result;
+        for (int attempt = 0; attempt < 2; attempt++) {
+            if (!co_await refreshToken()) {
+                r.errCode = 110;
+                r.errMessage = ocrErrorTable.at(r.errCode);
+                co_return -1;
+            }
+            string url = string(ocrUrl) + (ac ? "accurate_basic" : "general_basic")
+                         + "?access_token=" + formEscape(token);
+            string response;
+            CURLcode code;
+            co_await http.post(url, body, response, code);
+            result = Json::Value();
+            if (code != CURLE_OK) {
+                result["curl_error_code"] = static_cast<int>(code);
+                break;
+            }
+            Json::CharReaderBuilder builder;
+            std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+            if (!reader->parse(
+                    response.data(), response.data() + response.size(), &result, nullptr)) {
+                result = Json::Value();
+                result["error_code"] = 282000;
+                break;
+            }
+            int e = result.isMember("error_code") ? result["error_code"].asInt() : 0;
+            if (e != 110 && e != 111) {
+                break;
+            }
+            // token revoked or expired early, fetch a new one and send again
+            tokenExpiry = 0;
         }
-        Json::StreamWriterBuilder fwriter;
-        fwriter.settings_["indentation"] = "";
-        json.clear();
-        json = Json::writeString(fwriter, result);
-        return vstring.size();
-    }  // namespace fc
+        co_return parseResult(result, r.words, r.id, r.errMessage, r.errCode, r.json, curl);
+    }
+
+    // OcrClient END
 
     const std::vector<WaterMarker*>& WaterMarker::getMarkers()
     {
@@ -725,43 +1165,40 @@ namespace fc
             roi = cv::Rect(roiX, roiY, wcol, wrow);
         }
 
+        // a region of the image is not continuous, so the kernel runs row by row
+        void blendOverlay(Mat& base, const WaterMarker::Overlay& o)
+        {
+            size_t n = static_cast<size_t>(base.cols) * base.channels();
+            for (int y = 0; y < base.rows; y++) {
+                tb::blend::overlay(base.ptr<uint8_t>(y),
+                                   o.premultiplied.ptr<uint8_t>(y),
+                                   o.inverseAlpha.ptr<uint8_t>(y),
+                                   n);
+            }
+        }
+
     }  // namespace
 
     bool Image::addWaterMarker(const WaterMarker& wm)
     {
+        read();
         int baseHeight = imageMat.rows;
         int baseWidth = imageMat.cols;
-        wm.read();
-        read();
-        auto& markerMAT = wm.waterMarker->getMat();
-        auto& maskMAT = wm.waterMarkerMask;
-
-
-        Mat marker, mask;
-        if (baseWidth < 1000) {
-            //cv::resize(maskMAT, mask, cv::Size(0.7 * markerMAT.cols, 0.7 * markerMAT.rows));
-            if (markerMAT.channels() == 4) {
-                std::vector<cv::Mat> rgba;
-                split(markerMAT, rgba);
-                Mat alpha = Mat();
-                for (auto& c : rgba) {
-                    cv::resize(c, c, cv::Size(0.7 * markerMAT.cols, 0.7 * markerMAT.rows));
-                }
-                merge(rgba, marker);
-            } else {
-                cv::resize(markerMAT, marker, cv::Size(0.7 * markerMAT.cols, 0.7 * markerMAT.rows));
-            }
-        } else {
-            marker = markerMAT;
+        auto& overlay = wm.getOverlay(baseWidth);
+        if (overlay.premultiplied.empty()) {
+            unlock();
+            return false;
         }
-        int wmRow = marker.rows;
-        int wmCol = marker.cols;
+
+        int wmRow = overlay.premultiplied.rows;
+        int wmCol = overlay.premultiplied.cols;
         cv::Rect wmPos;
         wmPos.x = (baseWidth - wmCol) / 2;
         wmPos.y = (baseHeight - wmRow - wm.xOffset);
         wmPos.width = wmCol;
         wmPos.height = wmRow;
-        if ((wmPos.x + wmPos.width) > imageMat.cols || (wmPos.y + wmPos.height) > imageMat.rows) {
+        if (wmPos.x < 0 || wmPos.y < 0 || (wmPos.x + wmPos.width) > imageMat.cols ||
+            (wmPos.y + wmPos.height) > imageMat.rows) {
             const size_t bsize = 1024;
             char* buffer = tb::utils::requestMemory(bsize);
             snprintf(buffer,
@@ -776,30 +1213,15 @@ namespace fc
                      imageMat.rows);
             log_WARNING(buffer);
             tb::utils::releaseMemory(buffer);
-            wm.unlock();
+            unlock();
             return false;
         }
         unlock();
-        wm.unlock();
         _l.write();
+        CV_Assert(imageMat.type() == CV_8UC3);
         Mat imgROI = imageMat(wmPos);
-        if (marker.channels() == 3) {
-            log_DEBUG("TO BE IMPLEMENTED.");
-        } else if (markerMAT.channels() == 4) {
-            std::vector<cv::Mat> wm_channels;
-            std::vector<cv::Mat> img_channels;
-            split(imgROI, img_channels);
-            split(marker, wm_channels);
-            CV_Assert(wm_channels.size() == 4 && img_channels.size() == 3);
-            for (int i = 0; i < 3; i++) {
-                img_channels[i] = img_channels[i].mul(255.0 / wm.transparent - wm_channels[3],
-                                                      wm.transparent / 255);
-                img_channels[i] += wm_channels[i].mul(wm_channels[3], wm.transparent / 255.0);
-            }
-            merge(img_channels, imgROI);
-        }
+        blendOverlay(imgROI, overlay);
         _l.unlock();
-        unlock();
         return true;
     }
 }  // namespace fc
@@ -0,0 +1,173 @@
+#include "jpeg.h"
+
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+
+#include <jpeglib.h>
+
+namespace
+{
+    struct errorManager {
+        jpeg_error_mgr pub;
+        jmp_buf jump;
+    };
+
+    void onError(j_common_ptr c)
+    {
+        longjmp(reinterpret_cast<errorManager*>(c->err)->jump, 1);
+    }
+
+    void onMessage(j_common_ptr) {}
+
+    // destination growing a std::vector, the final size is set in term
+    struct vectorDestination {
+        jpeg_destination_mgr pub;
+        std::vector<uint8_t>* out;
+    };
+
+    void initDestination(j_compress_ptr c)
+    {
+        auto d = reinterpret_cast<vectorDestination*>(c->dest);
+        auto& v = *d->out;
+        if (v.size() < v.capacity()) {
+            v.resize(v.capacity());
+        }
+        if (v.size() < 4096) {
+            v.resize(4096);
+        }
+        d->pub.next_output_byte = v.data();
+        d->pub.free_in_buffer = v.size();
+    }
+
+    boolean emptyOutputBuffer(j_compress_ptr c)
+    {
+        auto d = reinterpret_cast<vectorDestination*>(c->dest);
+        auto& v = *d->out;
+        // libjpeg hands the whole buffer back when it is full
+        size_t used = v.size();
+        v.resize(used * 2);
+        d->pub.next_output_byte = v.data() + used;
+        d->pub.free_in_buffer = v.size() - used;
+        return TRUE;
+    }
+
+    void termDestination(j_compress_ptr c)
+    {
+        auto d = reinterpret_cast<vectorDestination*>(c->dest);
+        d->out->resize(d->out->size() - d->pub.free_in_buffer);
+    }
+
+    // one compressor per thread, jpeg_abort_compress() makes it reusable after an error
+    struct compressor {
+        jpeg_compress_struct cinfo;
+        errorManager err;
+        vectorDestination dest;
+#ifndef JCS_EXTENSIONS
+        std::vector<uint8_t> row;
+#endif
+
+        compressor()
+        {
+            cinfo.err = jpeg_std_error(&err.pub);
+            err.pub.error_exit = onError;
+            err.pub.output_message = onMessage;
+            jpeg_create_compress(&cinfo);
+            dest.pub.init_destination = initDestination;
+            dest.pub.empty_output_buffer = emptyOutputBuffer;
+            dest.pub.term_destination = termDestination;
+            dest.out = nullptr;
+        }
+        ~compressor()
+        {
+            jpeg_destroy_compress(&cinfo);
+        }
+    };
+
+    void setSampling(jpeg_compress_struct& c, tb::jpeg::subsampling s)
+    {
+        // luma factors, the chroma components stay at 1x1
+        int h = s == tb::jpeg::SAMP_444 ? 1 : 2;
+        int v = s == tb::jpeg::SAMP_420 ? 2 : 1;
+        c.comp_info[0].h_samp_factor = h;
+        c.comp_info[0].v_samp_factor = v;
+        for (int i = 1; i < c.num_components; i++) {
+            c.comp_info[i].h_samp_factor = 1;
+            c.comp_info[i].v_samp_factor = 1;
+        }
+    }
+}  // namespace
+
+namespace tb
+{
+    namespace jpeg
+    {
+        bool parseSubsampling(const char* name, subsampling& s)
+        {
+            if (strcmp(name, "444") == 0) {
+                s = SAMP_444;
+            } else if (strcmp(name, "422") == 0) {
+                s = SAMP_422;
+            } else if (strcmp(name, "420") == 0) {
+                s = SAMP_420;
+            } else {
+                return false;
+            }
+            return true;
+        }
+
+        bool encode(const uint8_t* bgr,
+                    int width,
+                    int height,
+                    size_t stride,
+                    const options& o,
+                    std::vector<uint8_t>& out)
+        {
+            thread_local compressor z;
+            auto& c = z.cinfo;
+            if (width <= 0 || height <= 0) {
+                out.clear();
+                return false;
+            }
+            if (setjmp(z.err.jump)) {
+                jpeg_abort_compress(&c);
+                out.clear();
+                return false;
+            }
+            z.dest.out = &out;
+            c.dest = &z.dest.pub;
+            c.image_width = width;
+            c.image_height = height;
+            c.input_components = 3;
+#ifdef JCS_EXTENSIONS
+            c.in_color_space = JCS_EXT_BGR;
+#else
+            c.in_color_space = JCS_RGB;
+            z.row.resize(static_cast<size_t>(width) * 3);
+#endif
+            jpeg_set_defaults(&c);
+            jpeg_set_quality(&c, o.quality, TRUE);
+            setSampling(c, o.sampling);
+            c.optimize_coding = o.optimize ? TRUE : FALSE;
+            if (o.progressive) {
+                jpeg_simple_progression(&c);
+            }
+            jpeg_start_compress(&c, TRUE);
+            while (c.next_scanline < c.image_height) {
+                auto src = const_cast<uint8_t*>(bgr + stride * c.next_scanline);
+#ifndef JCS_EXTENSIONS
+                for (int x = 0; x < width; x++) {
+                    z.row[3 * x] = src[3 * x + 2];
+                    z.row[3 * x + 1] = src[3 * x + 1];
+                    z.row[3 * x + 2] = src[3 * x];
+                }
+                src = z.row.data();
+#endif
+                JSAMPROW row = src;
+                jpeg_write_scanlines(&c, &row, 1);
+            }
+            jpeg_finish_compress(&c);
+            return true;
+        }
+    }  // namespace jpeg
+}  // namespace tb
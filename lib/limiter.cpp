@@ -0,0 +1,212 @@
+#include "limiter.h"
+#include "logger.h"
+
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+
+namespace
+{
+    const uint64_t second = 1000000;
+    // upper bound of a single sleep, so stop() is noticed quickly
+    const uint64_t slice = 100000;
+
+    // seconds until the next local midnight, when the Baidu daily quota is reset
+    uint64_t untilMidnight()
+    {
+        time_t t = time(nullptr);
+        struct tm local;
+        localtime_r(&t, &local);
+        local.tm_hour = 24;
+        local.tm_min = 0;
+        local.tm_sec = 0;
+        time_t next = mktime(&local);
+        return next > t ? static_cast<uint64_t>(next - t) : 1;
+    }
+}  // namespace
+
+namespace fc
+{
+    OcrLimiter* OcrLimiter::instance = nullptr;
+
+    OcrLimiter::OcrLimiter(uint64_t (*c)())
+        : maxRate(10),
+          minRate(0.5),
+          step(1),
+          rate(10),
+          tokens(1),
+          last(c()),
+          lastDecrease(0),
+          pauseUntil(0),
+          state(RUNNING),
+          stopped(false),
+          throttled(0),
+          clock(c)
+    {
+        publish();
+    }
+
+    OcrLimiter& OcrLimiter::getLimiter()
+    {
+        if (instance == nullptr) {
+            instance = new OcrLimiter();
+        }
+        return *instance;
+    }
+
+    void OcrLimiter::destroyLimiter()
+    {
+        delete instance;
+        instance = nullptr;
+    }
+
+    void OcrLimiter::configure(double max, double min, double s)
+    {
+        _m.lock();
+        maxRate = max > 0 ? max : 10;
+        minRate = min > 0 ? std::min(min, maxRate) : std::min(0.5, maxRate);
+        step = s > 0 ? s : 1;
+        rate = maxRate;
+        _m.unlock();
+        publish();
+    }
+
+    void OcrLimiter::publish()
+    {
+        static auto& r = tb::metrics::gauge("ocr_rate_qps", "Current OCR request rate limit.");
+        static auto& s = tb::metrics::gauge(
+            "ocr_limiter_state", "OCR limiter state, 0 running, 1 backoff, 2 paused.");
+        static auto& t = tb::metrics::gauge("ocr_throttled", "OCR requests refused by quota.");
+        r.set(getRate());
+        s.set(getState());
+        t.set(getThrottled());
+    }
+
+    int64_t OcrLimiter::tryAcquire()
+    {
+        _m.lock();
+        if (stopped) {
+            _m.unlock();
+            return -1;
+        }
+        auto t = clock();
+        int64_t wait = 0;
+        if (state == PAUSED) {
+            if (t < pauseUntil) {
+                wait = pauseUntil - t;
+            } else {
+                // the quota is back, ramp up again from the bottom
+                state = RUNNING;
+                rate = minRate;
+                tokens = 1;
+                last = t;
+                log_INFO("OCR daily quota reset, resuming requests.");
+            }
+        }
+        if (state != PAUSED) {
+            double burst = std::max(1.0, rate);
+            tokens = std::min(burst, tokens + (t - last) * rate / second);
+            last = t;
+            if (tokens >= 1) {
+                tokens -= 1;
+            } else {
+                wait = static_cast<int64_t>((1 - tokens) * second / rate) + 1;
+            }
+        }
+        _m.unlock();
+        return wait;
+    }
+
+    bool OcrLimiter::acquire()
+    {
+        do {
+            auto wait = tryAcquire();
+            if (wait <= 0) {
+                return wait == 0;
+            }
+            usleep(std::min(static_cast<uint64_t>(wait), slice));
+        } while (true);
+    }
+
+    bool OcrLimiter::report(int code)
+    {
+        bool ret = false;
+        char buffer[256];
+        buffer[0] = 0;
+        auto t = clock();
+        _m.lock();
+        if (code == 18 || code == 4) {
+            ret = true;
+            throttled++;
+            // one halving per second, the requests in flight all fail together
+            if (t - lastDecrease > second) {
+                rate = std::max(minRate, rate / 2);
+                lastDecrease = t;
+                tokens = 0;
+                snprintf(buffer, 256, "OCR QPS limit hit (%d), rate lowered to %.2f/s", code, rate);
+            }
+            if (state == RUNNING) {
+                state = BACKOFF;
+            }
+        } else if (code == 17 || code == 19) {
+            ret = true;
+            throttled++;
+            if (state != PAUSED) {
+                auto wait = untilMidnight();
+                state = PAUSED;
+                pauseUntil = t + wait * second;
+                tokens = 0;
+                snprintf(buffer,
+                         256,
+                         "OCR quota exhausted (%d), pausing requests for %lu s",
+                         code,
+                         wait);
+            }
+        } else if (code == 0) {
+            rate = std::min(maxRate, rate + step / rate);
+            if (state == BACKOFF && t - lastDecrease > second) {
+                state = RUNNING;
+            }
+        }
+        _m.unlock();
+        if (buffer[0] != 0) {
+            log_WARNING(buffer);
+        }
+        publish();
+        return ret;
+    }
+
+    void OcrLimiter::stop()
+    {
+        _m.lock();
+        if (!stopped && state == PAUSED) {
+            log_WARNING("OCR limiter stopped while paused, remaining requests fail.");
+        }
+        stopped = true;
+        _m.unlock();
+    }
+
+    double OcrLimiter::getRate() const
+    {
+        _m.lock();
+        auto r = rate;
+        _m.unlock();
+        return r;
+    }
+
+    OcrLimiter::State OcrLimiter::getState() const
+    {
+        _m.lock();
+        auto s = state;
+        _m.unlock();
+        return s;
+    }
+
+    uint64_t OcrLimiter::getThrottled() const
+    {
+        _m.lock();
+        auto t = throttled;
+        _m.unlock();
+        return t;
+    }
+}  // namespace fc
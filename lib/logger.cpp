@@ -135,7 +135,8 @@ namespace tb
         while (true) {
             msgQueueCond.wait(msgQueueMutex,
                               [this] { return stopping || this->msgQueue.size() > 0; });
-            if (stopping) {
+            // messages queued before the stop are still written
+            if (stopping && msgQueue.size() == 0) {
 #ifdef USE_POSIX_THREAD
                 msgQueueMutex.unlock();
 #endif
@@ -216,27 +217,18 @@ namespace tb
         accept.lock();
         Logger::instance->newLog = false;
         accept.unlock();
-        do {
-            msgMtx.lock();
-            auto value = Logger::instance->msgQueue.size();
-            msgMtx.unlock();
-            if (value > 0) {
-                sleep(1);
-            } else {
-                Logger::instance->stopping = true;
-                msgMtx.lock();
-                cond.notify_all();
-                msgMtx.unlock();
-                instance->join();
-                delete Logger::instance;
-                delete Logger::objPool;
-                Logger::LogMessageObject::charPool->~pool<>();
-                free(Logger::LogMessageObject::charPool);
-                Logger::objPool = nullptr;
-                Logger::instance = nullptr;
-                break;
-            }
-        } while (true);
+        // no new messages from here on, the writer drains the queue before it exits
+        msgMtx.lock();
+        Logger::instance->stopping = true;
+        cond.notify_all();
+        msgMtx.unlock();
+        instance->join();
+        delete Logger::instance;
+        delete Logger::objPool;
+        Logger::LogMessageObject::charPool->~pool<>();
+        free(Logger::LogMessageObject::charPool);
+        Logger::objPool = nullptr;
+        Logger::instance = nullptr;
     }
 
     Logger& Logger::getLogger(barrier* b)
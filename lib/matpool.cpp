@@ -0,0 +1,250 @@
+#include "matpool.h"
+
+#include <cstdlib>
+#include <opencv2/core.hpp>
+
+namespace
+{
+    const int firstExponent = 12;
+
+    // class of a size in (4 KiB, 4 GiB], -1 outside
+    int classOf(size_t s)
+    {
+        if (s <= (size_t(1) << firstExponent) || s > (size_t(1) << 32)) {
+            return -1;
+        }
+        // 2^e < s <= 2^(e + 1), split into quarters
+        int e = 63 - __builtin_clzll(s - 1);
+        size_t quarter = size_t(1) << (e - 2);
+        int k = static_cast<int>((s - 1 - (size_t(1) << e)) / quarter);
+        return (e - firstExponent) * 4 + k;
+    }
+
+    size_t sizeOf(int c)
+    {
+        int e = c / 4 + firstExponent;
+        return (size_t(1) << e) + (c % 4 + 1) * (size_t(1) << (e - 2));
+    }
+
+#if CV_VERSION_MAJOR >= 4
+    using accessFlag = cv::AccessFlag;
+#else
+    using accessFlag = int;
+#endif
+
+    // cv::Mat's StdMatAllocator with the data taken from a pool
+    class PooledAllocator : public cv::MatAllocator
+    {
+        tb::matpool::Pool& pool;
+        cv::MatAllocator* fallback;
+
+    public:
+        PooledAllocator(tb::matpool::Pool& p, cv::MatAllocator* f) : pool(p), fallback(f) {}
+
+        cv::UMatData* allocate(int dims,
+                               const int* sizes,
+                               int type,
+                               void* data0,
+                               size_t* step,
+                               accessFlag flags,
+                               cv::UMatUsageFlags usage) const override
+        {
+            size_t total = CV_ELEM_SIZE(type);
+            for (int i = dims - 1; i >= 0; i--) {
+                total *= sizes[i];
+            }
+            void* data = nullptr;
+            if (data0 == nullptr && total >= pool.getMinimum()) {
+                data = pool.acquire(total);
+            }
+            if (data == nullptr) {
+                // user data, small matrices and failures; the fallback reports out of memory
+                return fallback->allocate(dims, sizes, type, data0, step, flags, usage);
+            }
+            if (step != nullptr) {
+                size_t s = CV_ELEM_SIZE(type);
+                for (int i = dims - 1; i >= 0; i--) {
+                    step[i] = s;
+                    s *= sizes[i];
+                }
+            }
+            auto u = new cv::UMatData(this);
+            u->data = u->origdata = static_cast<uint8_t*>(data);
+            u->size = total;
+            return u;
+        }
+
+        bool allocate(cv::UMatData* u, accessFlag, cv::UMatUsageFlags) const override
+        {
+            return u != nullptr;
+        }
+
+        void deallocate(cv::UMatData* u) const override
+        {
+            if (u == nullptr) {
+                return;
+            }
+            pool.release(u->origdata, u->size);
+            u->origdata = nullptr;
+            delete u;
+        }
+    };
+
+    // both live until the process exits, matrices may be freed by static destructors
+    tb::matpool::Pool* installed = nullptr;
+    PooledAllocator* allocator = nullptr;
+}  // namespace
+
+namespace tb
+{
+    namespace matpool
+    {
+        struct Pool::Cache {
+            Pool* owner = nullptr;
+            std::vector<void*> lists[classCount];
+
+            ~Cache()
+            {
+                if (owner != nullptr) {
+                    owner->flush();
+                }
+            }
+        };
+
+        Pool::Cache& Pool::local()
+        {
+            thread_local Cache c;
+            return c;
+        }
+
+        Pool::Pool(size_t c, size_t m)
+            : cap(c), minimum(m), cached(0), hits(0), misses(0), dropped(0)
+        {
+        }
+
+        Pool::~Pool()
+        {
+            if (local().owner == this) {
+                flush();
+            }
+            for (auto& d : depot) {
+                for (auto p : d) {
+                    free(p);
+                }
+            }
+        }
+
+        size_t Pool::classSize(size_t s)
+        {
+            int c = classOf(s);
+            return c < 0 ? 0 : sizeOf(c);
+        }
+
+        void* Pool::acquire(size_t s)
+        {
+            int c = s < minimum ? -1 : classOf(s);
+            if (c < 0) {
+                return nullptr;
+            }
+            void* p = nullptr;
+            auto& l = local();
+            if (l.owner == this && !l.lists[c].empty()) {
+                p = l.lists[c].back();
+                l.lists[c].pop_back();
+            } else {
+                _m.lock();
+                if (!depot[c].empty()) {
+                    p = depot[c].back();
+                    depot[c].pop_back();
+                }
+                _m.unlock();
+            }
+            if (p != nullptr) {
+                cached.fetch_sub(sizeOf(c), std::memory_order_relaxed);
+                hits.fetch_add(1, std::memory_order_relaxed);
+                return p;
+            }
+            misses.fetch_add(1, std::memory_order_relaxed);
+            if (posix_memalign(&p, 4096, sizeOf(c)) != 0) {
+                return nullptr;
+            }
+            return p;
+        }
+
+        void Pool::release(void* p, size_t s)
+        {
+            if (p == nullptr) {
+                return;
+            }
+            int c = classOf(s);
+            if (c < 0) {
+                free(p);
+                return;
+            }
+            size_t size = sizeOf(c);
+            if (cached.fetch_add(size, std::memory_order_relaxed) + size > cap) {
+                cached.fetch_sub(size, std::memory_order_relaxed);
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                free(p);
+                return;
+            }
+            auto& l = local();
+            if (l.owner != this) {
+                // a thread caches for one pool only
+                if (l.owner != nullptr) {
+                    l.owner->flush();
+                }
+                l.owner = this;
+            }
+            if (l.lists[c].size() < static_cast<size_t>(localDepth)) {
+                l.lists[c].push_back(p);
+                return;
+            }
+            _m.lock();
+            depot[c].push_back(p);
+            _m.unlock();
+        }
+
+        void Pool::flush()
+        {
+            auto& l = local();
+            if (l.owner != this) {
+                return;
+            }
+            _m.lock();
+            for (int c = 0; c < classCount; c++) {
+                depot[c].insert(depot[c].end(), l.lists[c].begin(), l.lists[c].end());
+                l.lists[c].clear();
+            }
+            _m.unlock();
+            l.owner = nullptr;
+        }
+
+        void Pool::stats(Stats& s) const
+        {
+            s.hits = hits.load(std::memory_order_relaxed);
+            s.misses = misses.load(std::memory_order_relaxed);
+            s.dropped = dropped.load(std::memory_order_relaxed);
+            s.cached = cached.load(std::memory_order_relaxed);
+        }
+
+        void install(size_t cap, size_t minimum)
+        {
+            if (installed != nullptr) {
+                return;
+            }
+            installed = new Pool(cap, minimum);
+            allocator = new PooledAllocator(*installed, cv::Mat::getStdAllocator());
+            cv::Mat::setDefaultAllocator(allocator);
+        }
+
+        bool stats(Stats& s)
+        {
+            if (installed == nullptr) {
+                return false;
+            }
+            installed->stats(s);
+            return true;
+        }
+    }  // namespace matpool
+}  // namespace tb
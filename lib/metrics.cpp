@@ -0,0 +1,323 @@
+#include "metrics.h"
+#include "logger.h"
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+namespace
+{
+    std::atomic<unsigned int> shardSequence(0);
+
+    unsigned int shardIndex()
+    {
+        thread_local unsigned int index =
+            shardSequence.fetch_add(1, std::memory_order_relaxed) % tb::metrics::Stage::shardCount;
+        return index;
+    }
+
+    int bucketOf(uint64_t us)
+    {
+        int b = 0;
+        while (b < tb::metrics::Stage::bucketCount - 1 && us >= (1ull << b)) {
+            b++;
+        }
+        return b;
+    }
+}  // namespace
+
+namespace tb
+{
+    namespace metrics
+    {
+        uint64_t now()
+        {
+            struct timespec spec;
+            clock_gettime(CLOCK_MONOTONIC, &spec);
+            return static_cast<uint64_t>(spec.tv_sec) * 1000000 + spec.tv_nsec / 1000;
+        }
+
+        Stage::Stage(const char* n) : name(n)
+        {
+            for (auto& s : shards) {
+                s.in = s.out = s.failed = s.count = s.sum = 0;
+                for (auto& b : s.buckets) {
+                    b = 0;
+                }
+            }
+        }
+
+        Stage::Shard& Stage::local()
+        {
+            return shards[shardIndex()];
+        }
+
+        void Stage::enqueue()
+        {
+            local().in.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void Stage::dequeue()
+        {
+            local().out.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void Stage::fail()
+        {
+            local().failed.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void Stage::observe(uint64_t us)
+        {
+            auto& s = local();
+            s.count.fetch_add(1, std::memory_order_relaxed);
+            s.sum.fetch_add(us, std::memory_order_relaxed);
+            s.buckets[bucketOf(us)].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void Stage::snapshot(Snapshot& r) const
+        {
+            memset(&r, 0, sizeof r);
+            for (auto& s : shards) {
+                r.in += s.in.load(std::memory_order_relaxed);
+                r.out += s.out.load(std::memory_order_relaxed);
+                r.failed += s.failed.load(std::memory_order_relaxed);
+                r.count += s.count.load(std::memory_order_relaxed);
+                r.sum += s.sum.load(std::memory_order_relaxed);
+                for (int i = 0; i < bucketCount; i++) {
+                    r.buckets[i] += s.buckets[i].load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        Registry* Registry::instance = nullptr;
+
+        Registry::Registry() : thread("metrics"), interval(10), running(false) {}
+
+        Registry::~Registry()
+        {
+            for (auto s : stages) {
+                delete s;
+            }
+            for (auto g : gauges) {
+                delete g;
+            }
+        }
+
+        Registry& Registry::getRegistry()
+        {
+            if (instance == nullptr) {
+                instance = new Registry();
+            }
+            return *instance;
+        }
+
+        void Registry::destroyRegistry()
+        {
+            if (instance != nullptr) {
+                instance->stop();
+                delete instance;
+                instance = nullptr;
+            }
+        }
+
+        Stage& Registry::stage(const char* n)
+        {
+            _m.lock();
+            Stage* ret = nullptr;
+            for (auto s : stages) {
+                if (s->getName() == n) {
+                    ret = s;
+                    break;
+                }
+            }
+            if (ret == nullptr) {
+                ret = new Stage(n);
+                stages.push_back(ret);
+            }
+            _m.unlock();
+            return *ret;
+        }
+
+        Gauge& Registry::gauge(const char* n, const char* help)
+        {
+            _m.lock();
+            Gauge* ret = nullptr;
+            for (auto g : gauges) {
+                if (g->getName() == n) {
+                    ret = g;
+                    break;
+                }
+            }
+            if (ret == nullptr) {
+                ret = new Gauge(n, help);
+                gauges.push_back(ret);
+            }
+            _m.unlock();
+            return *ret;
+        }
+
+        std::string Registry::format()
+        {
+            _m.lock();
+            auto all = stages;
+            auto values = gauges;
+            _m.unlock();
+
+            std::vector<Stage::Snapshot> snaps(all.size());
+            for (size_t i = 0; i < all.size(); i++) {
+                all[i]->snapshot(snaps[i]);
+            }
+
+            std::string r;
+            char buffer[256];
+            auto series = [&](const char* metric,
+                              const char* type,
+                              const char* help,
+                              uint64_t (*value)(const Stage::Snapshot&)) {
+                r += std::string("# HELP ") + metric + " " + help + "\n";
+                r += std::string("# TYPE ") + metric + " " + type + "\n";
+                for (size_t i = 0; i < all.size(); i++) {
+                    snprintf(buffer,
+                             256,
+                             "%s{stage=\"%s\"} %lu\n",
+                             metric,
+                             all[i]->getName().c_str(),
+                             value(snaps[i]));
+                    r += buffer;
+                }
+            };
+            series("fchecker_stage_items_in_total",
+                   "counter",
+                   "Items queued to the stage.",
+                   [](const Stage::Snapshot& s) { return s.in; });
+            series("fchecker_stage_items_out_total",
+                   "counter",
+                   "Items taken from the stage queue.",
+                   [](const Stage::Snapshot& s) { return s.out; });
+            series("fchecker_stage_items_failed_total",
+                   "counter",
+                   "Items dropped by the stage.",
+                   [](const Stage::Snapshot& s) { return s.failed; });
+            series("fchecker_stage_queue_depth",
+                   "gauge",
+                   "Items waiting in the stage queue.",
+                   [](const Stage::Snapshot& s) { return s.in > s.out ? s.in - s.out : 0; });
+
+            const char* h = "fchecker_stage_service_seconds";
+            r += std::string("# HELP ") + h + " Service time of one item.\n";
+            r += std::string("# TYPE ") + h + " histogram\n";
+            for (size_t i = 0; i < all.size(); i++) {
+                auto& s = snaps[i];
+                auto n = all[i]->getName().c_str();
+                uint64_t cumulative = 0;
+                for (int b = 0; b < Stage::bucketCount; b++) {
+                    cumulative += s.buckets[b];
+                    if (b == Stage::bucketCount - 1) {
+                        snprintf(buffer,
+                                 256,
+                                 "%s_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n",
+                                 h,
+                                 n,
+                                 cumulative);
+                    } else {
+                        snprintf(buffer,
+                                 256,
+                                 "%s_bucket{stage=\"%s\",le=\"%g\"} %lu\n",
+                                 h,
+                                 n,
+                                 static_cast<double>(1ull << b) / 1e6,
+                                 cumulative);
+                    }
+                    r += buffer;
+                }
+                snprintf(buffer, 256, "%s_sum{stage=\"%s\"} %.6f\n", h, n, s.sum / 1e6);
+                r += buffer;
+                snprintf(buffer, 256, "%s_count{stage=\"%s\"} %lu\n", h, n, s.count);
+                r += buffer;
+            }
+
+            for (auto g : values) {
+                auto n = g->getName().c_str();
+                r += "# HELP fchecker_" + g->getName() + " " + g->getHelp() + "\n";
+                r += "# TYPE fchecker_" + g->getName() + " gauge\n";
+                snprintf(buffer, 256, "fchecker_%s %g\n", n, g->get());
+                r += buffer;
+            }
+            return r;
+        }
+
+        int Registry::writeFile()
+        {
+            if (path.empty()) {
+                return -1;
+            }
+            // readers never see a partial file: write a sibling, then rename over
+            auto content = format();
+            auto tmp = path + ".tmp";
+            int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd == -1) {
+                char buffer[512];
+                snprintf(buffer,
+                         512,
+                         "Open metrics file %s failed: %s",
+                         tmp.c_str(),
+                         strerror(errno));
+                log_ERROR(buffer);
+                return -1;
+            }
+            auto wrote = write(fd, content.data(), content.size());
+            close(fd);
+            if (wrote != static_cast<ssize_t>(content.size())
+                || rename(tmp.c_str(), path.c_str()) == -1) {
+                unlink(tmp.c_str());
+                return -1;
+            }
+            return 0;
+        }
+
+        void Registry::startReporter(const char* p, unsigned int _interval)
+        {
+            if (p == nullptr || *p == 0 || running) {
+                return;
+            }
+            path = p;
+            interval = _interval == 0 ? 1 : _interval;
+            running = true;
+            begin();
+        }
+
+        void Registry::stop()
+        {
+            if (running.exchange(false)) {
+                wake.notify_all();
+                join();
+                writeFile();
+            }
+        }
+
+        void* Registry::start(void*, void*, void*)
+        {
+            const uint64_t period = static_cast<uint64_t>(interval) * 1000000;
+            auto next = tb::thread_ns::monotonic_us() + period;
+            while (true) {
+                auto key = wake.prepare();
+                if (!running) {
+                    wake.cancel();
+                    break;
+                }
+                auto t = tb::thread_ns::monotonic_us();
+                if (t < next) {
+                    wake.wait_for(key, next - t);
+                    continue;
+                }
+                wake.cancel();
+                next = t + period;
+                writeFile();
+            }
+            return nullptr;
+        }
+    }  // namespace metrics
+}  // namespace tb
@@ -54,6 +54,14 @@ namespace tb
 
         void SFTPWorker::keepAlive()
         {
+            if (loop != nullptr) {
+                // the session belongs to the loop thread now
+                loop->post([this] {
+                    int next = 10;
+                    libssh2_keepalive_send(_session, &next);
+                });
+                return;
+            }
             int next = 10;
             libssh2_keepalive_send(_session, &next);
             log_INFO("Send Keep Alive Timer to remote.");
@@ -99,6 +107,7 @@ namespace tb
             value = 1;
             _session = nullptr;
             _sftpsession = nullptr;
+            loop = nullptr;
             ip = 0;
             status = CONNECTION_NOT_REAL_CONNECT;
             enabled = true;
@@ -129,6 +138,11 @@ namespace tb
             value = 0;
             tm.unlock();
             timer.join();
+            if (loop != nullptr) {
+                // the loop is gone by now, finish the session the simple way
+                libssh2_session_set_blocking(_session, 1);
+                loop = nullptr;
+            }
             libssh2_sftp_shutdown(_sftpsession);
             libssh2_session_disconnect(_session, "close");
             libssh2_session_free(_session);
@@ -266,6 +280,146 @@ namespace tb
             return ret;
         }
 
+        void SFTPWorker::attach(tb::async::event_loop& l)
+        {
+            if (status != CONNECTION_SUCCESS) {
+                return;
+            }
+            libssh2_session_set_blocking(_session, 0);
+            loop = &l;
+        }
+
+        tb::async::event_loop::io_awaiter SFTPWorker::blocked()
+        {
+            int dir = libssh2_session_block_directions(_session);
+            uint32_t events = 0;
+            if (dir & LIBSSH2_SESSION_BLOCK_INBOUND) {
+                events |= EPOLLIN;
+            }
+            if (dir & LIBSSH2_SESSION_BLOCK_OUTBOUND) {
+                events |= EPOLLOUT;
+            }
+            return loop->wait(_socket, events != 0 ? events : EPOLLIN | EPOLLOUT);
+        }
+
+        tb::async::task<int> SFTPWorker::mkparentAsync(string f)
+        {
+            string parent;
+            int ret;
+            if (tb::utils::getParentDir(f, parent)) {
+                ret = co_await mkparentAsync(parent);
+                if (ret == -1) {
+                    co_return -1;
+                }
+            }
+            LIBSSH2_SFTP_ATTRIBUTES attrib;
+            while ((ret = libssh2_sftp_stat(_sftpsession, f.c_str(), &attrib))
+                   == LIBSSH2_ERROR_EAGAIN) {
+                co_await blocked();
+            }
+            if (ret == 0) {
+                co_return LIBSSH2_SFTP_S_ISDIR(attrib.permissions) ? 0 : -1;
+            }
+            while ((ret = libssh2_sftp_mkdir(_sftpsession, f.c_str(), 0755))
+                   == LIBSSH2_ERROR_EAGAIN) {
+                co_await blocked();
+            }
+            co_return ret;
+        }
+
+        tb::async::task<int> SFTPWorker::sendFileAsync(string f, string rf)
+        {
+            if (status == CONNECTION_FAILED || loop == nullptr) {
+                co_return -1;
+            }
+            size_t fsize;
+            char* buffer;
+            char* file = reinterpret_cast<char*>(tb::utils::openFile(f.c_str(), fsize, &buffer));
+            if (file == nullptr) {
+                log_ERROR(buffer);
+                tb::utils::releaseMemory(buffer);
+                co_return -1;
+            }
+            struct stat st;
+            stat(f.c_str(), &st);
+            int ret = co_await sendBufferAsync(file, fsize, std::move(rf), st.st_mode & 0755);
+            char* destroyFileBuffer;
+            tb::utils::destroyFile(file, fsize, &destroyFileBuffer);
+            co_return ret;
+        }
+
+        tb::async::task<int> SFTPWorker::sendBufferAsync(const char* data,
+                                                         size_t size,
+                                                         string rf,
+                                                         int mode)
+        {
+            if (status == CONNECTION_FAILED || loop == nullptr) {
+                co_return -1;
+            }
+            const size_t bsize = 256;
+            char buf[bsize];
+            int ret = 0;
+            string remotefile = remotePath + "/" + rf;
+            string parent;
+            tb::utils::getParentDir(remotefile, parent);
+
+            LIBSSH2_CHANNEL* channel = nullptr;
+            if (co_await mkparentAsync(parent) != -1) {
+                do {
+                    channel = libssh2_scp_send(_session, remotefile.c_str(), mode, size);
+                    if (channel != nullptr
+                        || libssh2_session_last_errno(_session) != LIBSSH2_ERROR_EAGAIN) {
+                        break;
+                    }
+                    co_await blocked();
+                } while (true);
+                if (channel == nullptr) {
+                    checkSSHError();
+                    snprintf(buf, bsize, "Open SCP Channel failed: %s", errString);
+                    log_ERROR(buf);
+                }
+            }
+            if (channel == nullptr) {
+                co_return -1;
+            }
+            auto ptr = data;
+            auto s = size;
+            ssize_t wrote = 0;
+            while (s > 0) {
+                wrote = libssh2_channel_write(channel, ptr, s);
+                if (wrote == LIBSSH2_ERROR_EAGAIN) {
+                    co_await blocked();
+                } else if (wrote < 0) {
+                    break;
+                } else {
+                    ptr += wrote;
+                    s -= wrote;
+                }
+            }
+            if (wrote < 0) {
+                checkSSHError();
+                snprintf(buf, bsize, "Write file to Remote error: %s.", errString);
+                log_ERROR(buf);
+                ret = -1;
+            } else {
+                while (libssh2_channel_send_eof(channel) == LIBSSH2_ERROR_EAGAIN) {
+                    co_await blocked();
+                }
+                while (libssh2_channel_wait_eof(channel) == LIBSSH2_ERROR_EAGAIN) {
+                    co_await blocked();
+                }
+                while (libssh2_channel_wait_closed(channel) == LIBSSH2_ERROR_EAGAIN) {
+                    co_await blocked();
+                }
+                snprintf(buf, bsize, "Send %lu bytes -> %s successfully.", size, rf.c_str());
+                log_INFO(buf);
+            }
+            while (libssh2_channel_free(channel) == LIBSSH2_ERROR_EAGAIN) {
+                co_await blocked();
+            }
+            co_return ret;
+        }
+
         const char* SFTPWorker::tryConnect()
         {
             doConnect();
@@ -481,11 +635,17 @@ namespace tb
             return mysql_query(_remote, sql);
         }
 
-        void MySQLWorker::commit()
+        int MySQLWorker::commit()
         {
+            int ret = mysql_commit(_remote) ? -1 : 0;
             checkDBError();
-            mysql_commit(_remote);
             mysql_autocommit(_remote, AUTO_COMMIT_TRUE);
+            return ret;
+        }
+
+        const char* MySQLWorker::getErrorString() const
+        {
+            return errString;
         }
 
         bool MySQLWorker::tryConnect(const char** err)
@@ -0,0 +1,72 @@
+#include "gtest/gtest.h"
+
+#include <unistd.h>
+#include <atomic>
+#include "async.h"
+#include "metrics.h"
+
+using tb::async::event_loop;
+using tb::async::task;
+
+namespace
+{
+    task<int> twice(event_loop& loop, int v)
+    {
+        co_await loop.sleep(1000);
+        co_return v * 2;
+    }
+
+    task<void> readPipe(event_loop& loop, int fd, std::atomic<int>& got)
+    {
+        co_await loop.wait(fd, EPOLLIN);
+        char c;
+        if (read(fd, &c, 1) == 1) {
+            got = c;
+        }
+    }
+
+    task<void> chain(event_loop& loop, std::atomic<int>& sum)
+    {
+        int s = 0;
+        for (int i = 1; i <= 10; i++) {
+            s += co_await twice(loop, i);
+        }
+        sum = s;
+    }
+}  // namespace
+
+TEST(ASYNC, tasksAndTimers)
+{
+    event_loop loop;
+    loop.begin();
+    std::atomic<int> sum(0);
+    auto begin = tb::metrics::now();
+    loop.spawn(chain(loop, sum));
+    while (sum.load() == 0) {
+        usleep(1000);
+    }
+    EXPECT_EQ(sum.load(), 110);
+    // ten sequential 1 ms sleeps
+    EXPECT_GE(tb::metrics::now() - begin, 10000u);
+    loop.stop();
+}
+
+TEST(ASYNC, waitForDescriptor)
+{
+    event_loop loop;
+    loop.begin();
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    std::atomic<int> got(0);
+    loop.spawn(readPipe(loop, fds[0], got));
+    usleep(10000);
+    EXPECT_EQ(got.load(), 0);
+    ASSERT_EQ(write(fds[1], "x", 1), 1);
+    while (got.load() == 0) {
+        usleep(1000);
+    }
+    EXPECT_EQ(got.load(), 'x');
+    loop.stop();
+    close(fds[0]);
+    close(fds[1]);
+}
@@ -0,0 +1,106 @@
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+#include "blend.h"
+
+namespace
+{
+    uint8_t saturate(double v)
+    {
+        return static_cast<uint8_t>(std::min(255.0, std::max(0.0, std::round(v))));
+    }
+
+    // the per channel blend Image::addWaterMarker did before the kernels, kept in double
+    // where its 8 bit temporaries clipped 255 / t - alpha:
+    // base × (255 / t - alpha) × t / 255 + colour × alpha × t / 255
+    uint8_t reference(uint8_t base, uint8_t colour, uint8_t alpha, double t)
+    {
+        uint8_t kept = saturate(base * (255.0 / t - alpha) * t / 255);
+        uint8_t added = saturate(colour * alpha * t / 255.0);
+        return saturate(kept + added);
+    }
+
+    struct Planes {
+        std::vector<uint8_t> base, colour, alpha, premultiplied, inverse;
+
+        // n BGR pixels of a marker with `transparent` t, premultiplied as WaterMarker does
+        Planes(size_t n, double t, unsigned int seed)
+        {
+            srand(seed);
+            for (size_t i = 0; i < n; i++) {
+                uint8_t a = rand() % 4 == 0 ? 0 : rand() % 256;
+                for (int c = 0; c < 3; c++) {
+                    base.push_back(rand() % 256);
+                    colour.push_back(rand() % 256);
+                    alpha.push_back(a);
+                    premultiplied.push_back(saturate(colour.back() * a * t / 255.0));
+                    inverse.push_back(saturate(255 - a * t));
+                }
+            }
+        }
+    };
+}  // namespace
+
+TEST(BLEND, matchesFloatFormula)
+{
+    for (double t : {1.0, 0.6, 0.25}) {
+        Planes p(4099, t, 7);
+        auto out = p.base;
+        tb::blend::overlay(out.data(), p.premultiplied.data(), p.inverse.data(), out.size());
+        int worst = 0;
+        for (size_t i = 0; i < out.size(); i++) {
+            int want = reference(p.base[i], p.colour[i], p.alpha[i], t);
+            worst = std::max(worst, std::abs(want - out[i]));
+        }
+        // one rounding step for each of the two products
+        EXPECT_LE(worst, 2) << "transparent " << t;
+    }
+}
+
+TEST(BLEND, kernelsAgree)
+{
+    auto scalar = tb::blend::find("scalar");
+    ASSERT_NE(scalar, nullptr);
+    EXPECT_EQ(tb::blend::find("neon-on-x86"), nullptr);
+    Planes p(1000, 0.8, 11);
+    for (const char* name : {"sse4.1", "avx2"}) {
+        auto k = tb::blend::find(name);
+        if (k == nullptr) {
+            continue;
+        }
+        // odd lengths and offsets exercise the unaligned loads and the scalar tail
+        for (size_t offset : {0u, 1u, 5u}) {
+            for (size_t n : {0u, 1u, 15u, 16u, 33u, 95u, 2989u}) {
+                auto want = p.base;
+                auto got = p.base;
+                scalar(want.data() + offset,
+                       p.premultiplied.data() + offset,
+                       p.inverse.data() + offset,
+                       n);
+                k(got.data() + offset,
+                  p.premultiplied.data() + offset,
+                  p.inverse.data() + offset,
+                  n);
+                EXPECT_EQ(want, got) << name << " offset " << offset << " n " << n;
+            }
+        }
+    }
+}
+
+TEST(BLEND, opaqueAndClear)
+{
+    std::vector<uint8_t> dst = {10, 200, 255, 0};
+    std::vector<uint8_t> premultiplied = {50, 60, 70, 80};
+    std::vector<uint8_t> opaque(4, 0);
+    tb::blend::overlay(dst.data(), premultiplied.data(), opaque.data(), dst.size());
+    EXPECT_EQ(dst, premultiplied);
+
+    std::vector<uint8_t> none(4, 0);
+    std::vector<uint8_t> clear(4, 255);
+    auto keep = dst;
+    tb::blend::overlay(dst.data(), none.data(), clear.data(), dst.size());
+    EXPECT_EQ(dst, keep);
+}
@@ -0,0 +1,122 @@
+#include "gtest/gtest.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "jpeg.h"
+
+#include <jpeglib.h>
+
+namespace
+{
+    const int width = 321;
+    const int height = 203;
+
+    // smooth BGR gradient with a little noise, rows padded like a cv::Mat region
+    std::vector<uint8_t> picture(size_t stride)
+    {
+        std::vector<uint8_t> p(stride * height);
+        srand(3);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                uint8_t* px = &p[y * stride + 3 * x];
+                px[0] = x * 255 / width;
+                px[1] = y * 255 / height;
+                px[2] = 128 + rand() % 8;
+            }
+        }
+        return p;
+    }
+
+    // decodes back to BGR, returns the mean absolute error against `src`
+    double roundTrip(const std::vector<uint8_t>& jpg,
+                     const std::vector<uint8_t>& src,
+                     size_t stride)
+    {
+        jpeg_decompress_struct d;
+        jpeg_error_mgr err;
+        d.err = jpeg_std_error(&err);
+        jpeg_create_decompress(&d);
+        jpeg_mem_src(&d, jpg.data(), jpg.size());
+        jpeg_read_header(&d, TRUE);
+        d.out_color_space = JCS_RGB;
+        jpeg_start_decompress(&d);
+        EXPECT_EQ(d.output_width, static_cast<unsigned>(width));
+        EXPECT_EQ(d.output_height, static_cast<unsigned>(height));
+        std::vector<uint8_t> row(d.output_width * 3);
+        double sum = 0;
+        while (d.output_scanline < d.output_height) {
+            int y = d.output_scanline;
+            JSAMPROW r = row.data();
+            jpeg_read_scanlines(&d, &r, 1);
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < 3; c++) {
+                    sum += std::abs(row[3 * x + c] - src[y * stride + 3 * x + 2 - c]);
+                }
+            }
+        }
+        jpeg_finish_decompress(&d);
+        jpeg_destroy_decompress(&d);
+        return sum / (width * height * 3);
+    }
+
+    bool progressive(const std::vector<uint8_t>& jpg)
+    {
+        for (size_t i = 0; i + 1 < jpg.size(); i++) {
+            if (jpg[i] == 0xFF && jpg[i + 1] == 0xC2) {
+                return true;
+            }
+        }
+        return false;
+    }
+}  // namespace
+
+TEST(JPEG, encodesBGRRows)
+{
+    size_t stride = width * 3 + 13;
+    auto src = picture(stride);
+    tb::jpeg::options o;
+    std::vector<uint8_t> out;
+    ASSERT_TRUE(tb::jpeg::encode(src.data(), width, height, stride, o, out));
+    ASSERT_GT(out.size(), 4u);
+    EXPECT_EQ(out[0], 0xFF);
+    EXPECT_EQ(out[1], 0xD8);
+    EXPECT_EQ(out[out.size() - 2], 0xFF);
+    EXPECT_EQ(out[out.size() - 1], 0xD9);
+    EXPECT_LT(roundTrip(out, src, stride), 3.0);
+    EXPECT_FALSE(progressive(out));
+}
+
+TEST(JPEG, optionsAndReuse)
+{
+    size_t stride = width * 3;
+    auto src = picture(stride);
+    tb::jpeg::options o;
+    o.sampling = tb::jpeg::SAMP_444;
+    std::vector<uint8_t> plain, optimized;
+    ASSERT_TRUE(tb::jpeg::encode(src.data(), width, height, stride, o, plain));
+    o.optimize = true;
+    ASSERT_TRUE(tb::jpeg::encode(src.data(), width, height, stride, o, optimized));
+    EXPECT_LT(optimized.size(), plain.size());
+    EXPECT_LT(roundTrip(optimized, src, stride), 3.0);
+
+    o.progressive = true;
+    std::vector<uint8_t> out;
+    ASSERT_TRUE(tb::jpeg::encode(src.data(), width, height, stride, o, out));
+    EXPECT_TRUE(progressive(out));
+    EXPECT_LT(roundTrip(out, src, stride), 3.0);
+
+    // the second encode of the same picture fits the first one's buffer
+    auto data = out.data();
+    ASSERT_TRUE(tb::jpeg::encode(src.data(), width, height, stride, o, out));
+    EXPECT_EQ(out.data(), data);
+
+    EXPECT_FALSE(tb::jpeg::encode(src.data(), 0, height, stride, o, out));
+    EXPECT_TRUE(out.empty());
+
+    tb::jpeg::subsampling s = tb::jpeg::SAMP_420;
+    EXPECT_TRUE(tb::jpeg::parseSubsampling("422", s));
+    EXPECT_EQ(s, tb::jpeg::SAMP_422);
+    EXPECT_FALSE(tb::jpeg::parseSubsampling("411", s));
+    EXPECT_EQ(s, tb::jpeg::SAMP_422);
+}
@@ -0,0 +1,99 @@
+#include "gtest/gtest.h"
+
+#include "limiter.h"
+
+using fc::OcrLimiter;
+
+namespace
+{
+    const uint64_t second = 1000000;
+    uint64_t fakeNow = 0;
+
+    uint64_t fakeClock()
+    {
+        return fakeNow;
+    }
+}  // namespace
+
+TEST(LIMITER, halvesOncePerSecond)
+{
+    fakeNow = 100 * second;
+    OcrLimiter l(fakeClock);
+    l.configure(8, 0.5, 1);
+    EXPECT_EQ(l.getState(), OcrLimiter::RUNNING);
+
+    EXPECT_TRUE(l.report(18));
+    EXPECT_DOUBLE_EQ(l.getRate(), 4);
+    EXPECT_EQ(l.getState(), OcrLimiter::BACKOFF);
+    // the rest of the requests in flight fail together, only one halving
+    EXPECT_TRUE(l.report(4));
+    EXPECT_DOUBLE_EQ(l.getRate(), 4);
+    EXPECT_EQ(l.getThrottled(), 2u);
+
+    for (double want : {2.0, 1.0, 0.5, 0.5}) {
+        fakeNow += second + 1;
+        l.report(4);
+        EXPECT_DOUBLE_EQ(l.getRate(), want);
+    }
+}
+
+TEST(LIMITER, additiveIncrease)
+{
+    fakeNow = 100 * second;
+    OcrLimiter l(fakeClock);
+    l.configure(10, 0.5, 1);
+    l.report(18);
+    EXPECT_DOUBLE_EQ(l.getRate(), 5);
+    EXPECT_FALSE(l.report(0));
+    EXPECT_DOUBLE_EQ(l.getRate(), 5.2);
+    // still inside the second after the halving
+    EXPECT_EQ(l.getState(), OcrLimiter::BACKOFF);
+    fakeNow += second + 1;
+    for (int i = 0; i < 1000; i++) {
+        l.report(0);
+    }
+    EXPECT_DOUBLE_EQ(l.getRate(), 10);
+    EXPECT_EQ(l.getState(), OcrLimiter::RUNNING);
+}
+
+TEST(LIMITER, pausesOnQuotaAndRampsUp)
+{
+    fakeNow = 100 * second;
+    OcrLimiter l(fakeClock);
+    l.configure(10, 0.5, 1);
+    EXPECT_EQ(l.tryAcquire(), 0);
+
+    EXPECT_TRUE(l.report(17));
+    EXPECT_EQ(l.getState(), OcrLimiter::PAUSED);
+    EXPECT_GT(l.tryAcquire(), 0);
+    fakeNow += second;
+    EXPECT_GT(l.tryAcquire(), 0);
+    // a total quota error while paused does not move the pause
+    EXPECT_TRUE(l.report(19));
+    EXPECT_EQ(l.getState(), OcrLimiter::PAUSED);
+
+    // past the next midnight the quota is back, requests restart at the floor
+    fakeNow += 25 * 3600 * second;
+    EXPECT_EQ(l.tryAcquire(), 0);
+    EXPECT_EQ(l.getState(), OcrLimiter::RUNNING);
+    EXPECT_DOUBLE_EQ(l.getRate(), 0.5);
+    // the next token at 0.5/s is two seconds away
+    auto wait = l.tryAcquire();
+    EXPECT_GT(wait, static_cast<int64_t>(second));
+    EXPECT_LE(wait, static_cast<int64_t>(2 * second + 1));
+    l.report(0);
+    EXPECT_DOUBLE_EQ(l.getRate(), 2.5);
+}
+
+TEST(LIMITER, stopFailsRequests)
+{
+    fakeNow = 100 * second;
+    OcrLimiter l(fakeClock);
+    l.configure(10, 0.5, 1);
+    EXPECT_TRUE(l.acquire());
+    l.report(17);
+    l.stop();
+    // even while paused, nothing waits for midnight
+    EXPECT_FALSE(l.acquire());
+    EXPECT_EQ(l.tryAcquire(), -1);
+}
@@ -0,0 +1,97 @@
+#include "gtest/gtest.h"
+
+#include <cstring>
+#include <thread>
+#include "matpool.h"
+
+namespace
+{
+    const size_t K = 1024;
+}  // namespace
+
+TEST(MATPOOL, sizeClasses)
+{
+    EXPECT_EQ(tb::matpool::Pool::classSize(4 * K), 0u);
+    EXPECT_EQ(tb::matpool::Pool::classSize(4 * K + 1), 5 * K);
+    EXPECT_EQ(tb::matpool::Pool::classSize(256 * K), 256 * K);
+    EXPECT_EQ(tb::matpool::Pool::classSize(256 * K + 1), 320 * K);
+    EXPECT_EQ(tb::matpool::Pool::classSize(4000 * 3000 * 3), 40u * K * K);
+    EXPECT_EQ(tb::matpool::Pool::classSize(size_t(4) << 30), size_t(4) << 30);
+    EXPECT_EQ(tb::matpool::Pool::classSize((size_t(4) << 30) + 1), 0u);
+    // never more than a quarter wasted
+    for (size_t s = 4 * K + 1; s < 64 * K * K; s = s * 9 / 7) {
+        size_t c = tb::matpool::Pool::classSize(s);
+        EXPECT_GE(c, s);
+        EXPECT_LE(c, s + s / 4 + 1) << s;
+    }
+}
+
+TEST(MATPOOL, reusesReleasedBuffers)
+{
+    tb::matpool::Pool pool(64 * K * K, 256 * K);
+    tb::matpool::Stats s;
+    EXPECT_EQ(pool.acquire(100 * K), nullptr);
+
+    void* a = pool.acquire(3 * K * K);
+    ASSERT_NE(a, nullptr);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(a) % 4096, 0u);
+    memset(a, 1, 3 * K * K);
+    pool.release(a, 3 * K * K);
+    pool.stats(s);
+    EXPECT_EQ(s.cached, 3 * K * K);
+
+    // the same class, not necessarily the same size
+    void* b = pool.acquire(3 * K * K - 100);
+    EXPECT_EQ(a, b);
+    pool.stats(s);
+    EXPECT_EQ(s.hits, 1u);
+    EXPECT_EQ(s.misses, 1u);
+    EXPECT_EQ(s.cached, 0u);
+    pool.release(b, 3 * K * K - 100);
+}
+
+TEST(MATPOOL, capDropsBuffers)
+{
+    tb::matpool::Pool pool(K * K, 256 * K);
+    void* a = pool.acquire(768 * K);
+    void* b = pool.acquire(768 * K);
+    pool.release(a, 768 * K);
+    pool.release(b, 768 * K);
+    tb::matpool::Stats s;
+    pool.stats(s);
+    EXPECT_EQ(s.dropped, 1u);
+    EXPECT_EQ(s.cached, 768 * K);
+}
+
+TEST(MATPOOL, crossThreadRelease)
+{
+    tb::matpool::Pool pool(64 * K * K, 256 * K);
+    const int n = tb::matpool::Pool::localDepth + 3;
+    void* p[n];
+    for (int i = 0; i < n; i++) {
+        p[i] = pool.acquire(K * K);
+    }
+    // freed by a thread that exits, its cached buffers end up in the depot
+    std::thread t([&]() {
+        for (int i = 0; i < n; i++) {
+            pool.release(p[i], K * K);
+        }
+    });
+    t.join();
+    for (int i = 0; i < n; i++) {
+        p[i] = pool.acquire(K * K);
+        EXPECT_NE(p[i], nullptr);
+    }
+    tb::matpool::Stats s;
+    pool.stats(s);
+    EXPECT_EQ(s.hits, static_cast<uint64_t>(n));
+    EXPECT_EQ(s.misses, static_cast<uint64_t>(n));
+    EXPECT_EQ(s.cached, 0u);
+    void* last = pool.acquire(K * K);
+    pool.stats(s);
+    EXPECT_EQ(s.misses, static_cast<uint64_t>(n + 1));
+    pool.release(last, K * K);
+    for (int i = 0; i < n; i++) {
+        pool.release(p[i], K * K);
+    }
+}
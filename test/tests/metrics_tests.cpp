@@ -0,0 +1,68 @@
+#include "gtest/gtest.h"
+
+#include <unistd.h>
+#include <string>
+#include "metrics.h"
+
+using tb::metrics::Stage;
+
+TEST(METRICS, stageCounters)
+{
+    Stage s("unit");
+    s.enqueue();
+    s.enqueue();
+    s.dequeue();
+    s.fail();
+    s.observe(0);
+    s.observe(3);
+    s.observe(1000);
+
+    Stage::Snapshot r;
+    s.snapshot(r);
+    EXPECT_EQ(r.in, 2u);
+    EXPECT_EQ(r.out, 1u);
+    EXPECT_EQ(r.failed, 1u);
+    EXPECT_EQ(r.count, 3u);
+    EXPECT_EQ(r.sum, 1003u);
+    EXPECT_EQ(r.buckets[0], 1u);   // < 1us
+    EXPECT_EQ(r.buckets[2], 1u);   // < 4us
+    EXPECT_EQ(r.buckets[10], 1u);  // < 1024us
+}
+
+TEST(METRICS, prometheusFormat)
+{
+    auto& reg = tb::metrics::Registry::getRegistry();
+    auto& s = reg.stage("format");
+    EXPECT_EQ(&s, &reg.stage("format"));
+    s.enqueue();
+    s.observe(5);
+    auto text = reg.format();
+    EXPECT_NE(text.find("fchecker_stage_queue_depth{stage=\"format\"} 1"), std::string::npos);
+    EXPECT_NE(text.find("fchecker_stage_service_seconds_count{stage=\"format\"} 1"),
+              std::string::npos);
+    EXPECT_NE(text.find("fchecker_stage_service_seconds_bucket{stage=\"format\",le=\"+Inf\"} 1"),
+              std::string::npos);
+}
+
+TEST(METRICS, gauge)
+{
+    auto& g = tb::metrics::gauge("unit_rate", "A test gauge.");
+    g.set(2.5);
+    auto text = tb::metrics::Registry::getRegistry().format();
+    EXPECT_NE(text.find("# TYPE fchecker_unit_rate gauge"), std::string::npos);
+    EXPECT_NE(text.find("fchecker_unit_rate 2.5"), std::string::npos);
+}
+
+TEST(METRICS, reporterStopsPromptly)
+{
+    auto& reg = tb::metrics::Registry::getRegistry();
+    std::string path = "/tmp/metrics_tests_" + std::to_string(getpid()) + ".prom";
+    reg.startReporter(path.c_str(), 60);
+    auto begin = tb::metrics::now();
+    reg.stop();
+    // the reporter does not finish its minute before it exits
+    EXPECT_LT(tb::metrics::now() - begin, 500000u);
+    // stop() writes a last snapshot
+    EXPECT_EQ(access(path.c_str(), F_OK), 0);
+    unlink(path.c_str());
+}
@@ -0,0 +1,295 @@
+#include "gtest/gtest.h"
+
+#include <pthread.h>
+#include <unistd.h>
+#include <atomic>
+#include <functional>
+#include <vector>
+#include "threads.h"
+
+using tb::thread_ns::mpmc_queue;
+
+namespace
+{
+    const long perProducer = 100000;
+
+    struct QueueArgs {
+        mpmc_queue<long>* q;
+        long sum;
+        long count;
+    };
+
+    void* produce(void* p)
+    {
+        auto a = reinterpret_cast<QueueArgs*>(p);
+        for (long i = 1; i <= perProducer; i++) {
+            a->q->push(i);
+        }
+        return nullptr;
+    }
+
+    void* consume(void* p)
+    {
+        auto a = reinterpret_cast<QueueArgs*>(p);
+        long v;
+        while (a->q->pop(v)) {
+            a->sum += v;
+            a->count++;
+        }
+        return nullptr;
+    }
+}  // namespace
+
+TEST(THREADS, mpmcSingleThread)
+{
+    mpmc_queue<int> q(3);
+    EXPECT_EQ(q.capacity(), 4u);
+    for (int i = 0; i < 4; i++) {
+        EXPECT_TRUE(q.try_push(i));
+    }
+    EXPECT_FALSE(q.try_push(4));
+    int v;
+    for (int i = 0; i < 4; i++) {
+        EXPECT_TRUE(q.try_pop(v));
+        EXPECT_EQ(v, i);
+    }
+    EXPECT_FALSE(q.try_pop(v));
+}
+
+TEST(THREADS, mpmcClose)
+{
+    mpmc_queue<int> q(8);
+    q.push(1);
+    q.push(2);
+    q.close();
+    EXPECT_FALSE(q.push(3));
+    int v;
+    EXPECT_TRUE(q.pop(v));
+    EXPECT_EQ(v, 1);
+    EXPECT_TRUE(q.pop(v));
+    EXPECT_EQ(v, 2);
+    EXPECT_FALSE(q.pop(v));
+}
+
+TEST(THREADS, mpmcManyProducersConsumers)
+{
+    const int producers = 4;
+    const int consumers = 4;
+    mpmc_queue<long> q(16);
+    std::vector<QueueArgs> args(producers + consumers, QueueArgs{&q, 0, 0});
+    std::vector<pthread_t> tids(producers + consumers);
+    for (int i = 0; i < consumers; i++) {
+        pthread_create(&tids[i], nullptr, consume, &args[i]);
+    }
+    for (int i = consumers; i < producers + consumers; i++) {
+        pthread_create(&tids[i], nullptr, produce, &args[i]);
+    }
+    for (int i = consumers; i < producers + consumers; i++) {
+        pthread_join(tids[i], nullptr);
+    }
+    q.close();
+    long sum = 0, count = 0;
+    for (int i = 0; i < consumers; i++) {
+        pthread_join(tids[i], nullptr);
+        sum += args[i].sum;
+        count += args[i].count;
+    }
+    EXPECT_EQ(count, producers * perProducer);
+    EXPECT_EQ(sum, producers * perProducer * (perProducer + 1) / 2);
+}
+
+TEST(THREADS, timerWheelOrder)
+{
+    tb::thread_ns::timer_wheel<int> w;
+    std::vector<uint64_t> delays = {1, 5, 63, 64, 65, 200, 4095, 4096, 5000, 300000};
+    for (size_t i = 0; i < delays.size(); i++) {
+        w.schedule(static_cast<int>(i), delays[i]);
+    }
+    EXPECT_EQ(w.size(), delays.size());
+    std::vector<std::pair<int, uint64_t>> fired;
+    for (uint64_t t = 1; t <= 300000; t++) {
+        w.advance(t, [&](int& v) { fired.emplace_back(v, t); });
+    }
+    ASSERT_EQ(fired.size(), delays.size());
+    for (auto& f : fired) {
+        EXPECT_EQ(f.second, delays[f.first]);
+    }
+    EXPECT_EQ(w.size(), 0u);
+}
+
+TEST(THREADS, timerWheelJumpAndFlush)
+{
+    tb::thread_ns::timer_wheel<int> w(1000);
+    w.schedule(1, 10);
+    w.schedule(2, 100000);
+    int got = 0;
+    EXPECT_EQ(w.advance(1000 + 50, [&](int& v) { got = v; }), 1u);
+    EXPECT_EQ(got, 1);
+    EXPECT_EQ(w.flush([&](int& v) { got = v; }), 1u);
+    EXPECT_EQ(got, 2);
+    EXPECT_EQ(w.size(), 0u);
+}
+
+TEST(THREADS, executorRunsEverything)
+{
+    std::atomic<long> sum(0);
+    {
+        tb::thread_ns::executor ex(4);
+        for (long i = 1; i <= 1000; i++) {
+            ex.submit([&sum, &ex, i] {
+                sum += i;
+                // nested submissions land on the submitting worker's own deque
+                ex.submit([&sum] { sum += 1; });
+            });
+        }
+        ex.stop();
+    }
+    EXPECT_EQ(sum.load(), 1000 * 1001 / 2 + 1000);
+}
+
+TEST(THREADS, taskGraphPipeline)
+{
+    tb::thread_ns::executor ex(4);
+    tb::thread_ns::task_graph g(ex);
+    std::atomic<long> sum(0);
+    std::atomic<int> running(0);
+    std::atomic<int> peak(0);
+    auto& last = g.add<long>(1, [&](long& v) {
+        int r = ++running;
+        int p = peak.load();
+        while (r > p && !peak.compare_exchange_weak(p, r))
+            ;
+        sum += v;
+        running--;
+    });
+    auto& first = g.add<long>(3, [&](long& v) { last.post(v * 2); });
+    g.throttle(first, last, [] { return 4L; });
+    for (long i = 1; i <= 500; i++) {
+        first.post(i);
+    }
+    g.wait_idle();
+    EXPECT_EQ(g.size(), 0);
+    EXPECT_EQ(sum.load(), 500 * 501);
+    EXPECT_EQ(peak.load(), 1);
+    EXPECT_LE(last.load(), 4u);
+    ex.stop();
+}
+
+TEST(THREADS, taskGraphAsyncStage)
+{
+    tb::thread_ns::executor ex(2);
+    tb::thread_ns::task_graph g(ex);
+    std::atomic<long> sum(0);
+    std::vector<std::function<void()>> parked;
+    tb::thread_ns::mutex m;
+    auto& s = g.add_async<long>(8, [&](long& v, std::function<void()> done) {
+        sum += v;
+        m.lock();
+        parked.push_back(done);
+        m.unlock();
+    });
+    for (long i = 1; i <= 8; i++) {
+        s.post(i);
+    }
+    // every item stays running until its completion is called
+    while (sum.load() != 36) {
+        usleep(1000);
+    }
+    EXPECT_EQ(s.load(), 8u);
+    EXPECT_EQ(g.size(), 8);
+    m.lock();
+    for (auto& done : parked) {
+        done();
+    }
+    m.unlock();
+    g.wait_idle();
+    EXPECT_EQ(s.load(), 0u);
+    ex.stop();
+}
+
+TEST(THREADS, eventCountTimedWait)
+{
+    tb::thread_ns::event_count e;
+    auto begin = tb::thread_ns::monotonic_us();
+    auto key = e.prepare();
+    EXPECT_FALSE(e.wait_for(key, 20000));
+    EXPECT_GE(tb::thread_ns::monotonic_us() - begin, 20000u);
+
+    tb::thread_ns::executor ex(1);
+    key = e.prepare();
+    ex.submit([&e] {
+        usleep(5000);
+        e.notify_all();
+    });
+    EXPECT_TRUE(e.wait_for(key, 10000000));
+    ex.stop();
+}
+
+TEST(THREADS, taskGraphIdleDeadline)
+{
+    tb::thread_ns::executor ex(2);
+    tb::thread_ns::task_graph g(ex);
+    std::atomic<bool> release(false);
+    auto& s = g.add<int>(1, [&release](int&) {
+        while (!release) {
+            usleep(1000);
+        }
+    });
+    s.post(1);
+    EXPECT_FALSE(g.wait_idle_until(tb::thread_ns::monotonic_us() + 20000));
+    release = true;
+    EXPECT_TRUE(g.wait_idle_until(tb::thread_ns::monotonic_us() + 10000000));
+    ex.stop();
+}
+
+// OcrHandlerQueue's arrangement: failures are parked outside the graph and come back later,
+// the processing stage is throttled by a window that closes while the parking lot is full
+TEST(THREADS, taskGraphRetriesHoldBackIntake)
+{
+    const long items = 200;
+    const size_t cap = 8;
+    const long window = 4;
+    tb::thread_ns::executor ex(4);
+    tb::thread_ns::task_graph g(ex);
+    tb::thread_ns::mutex m;
+    std::vector<long> lot;
+    std::atomic<size_t> parked(0);
+    size_t peak = 0;
+    std::vector<int> attempts(items, 0);
+    std::atomic<long> ok(0);
+
+    auto& ocr = g.add<long>(2, [&](long& v) {
+        // every item fails three times before it goes through
+        if (++attempts[v] <= 3) {
+            m.lock();
+            lot.push_back(v);
+            parked++;
+            peak = std::max(peak, lot.size());
+            m.unlock();
+            return;
+        }
+        ok++;
+    });
+    auto& process = g.add<long>(2, [&](long& v) { ocr.post(v); });
+    g.throttle(process, ocr, [&] { return parked.load() >= cap ? 0L : window; });
+    for (long i = 0; i < items; i++) {
+        process.post(i);
+    }
+    // the retry timer: hands the parked items back after a while
+    for (int spins = 0; ok.load() < items && spins < 10000; spins++) {
+        usleep(1000);
+        m.lock();
+        auto back = std::move(lot);
+        lot.clear();
+        m.unlock();
+        for (auto v : back) {
+            ocr.post(v);
+            parked--;
+        }
+    }
+    g.wait_idle();
+    // nothing is dropped, and admitted requests overshoot the cap by at most one window
+    EXPECT_EQ(ok.load(), items);
+    EXPECT_LE(peak, cap + window + 2);
+    ex.stop();
+}
@@ -0,0 +1,77 @@
+// Compares the old ItemProcessor pacing (a random sleep after every item) with the
+// task_graph::throttle admission the pipeline uses, against a simulated OCR stage.
+// Usage: admissionBench [items] [processors] [ocr]
+#include "threads.h"
+
+#include <time.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+
+using tb::thread_ns::executor;
+using tb::thread_ns::task_graph;
+
+namespace
+{
+    // CPU time of watermarking one triplet and latency of one OCR round-trip
+    const useconds_t processUs = 5000;
+    const useconds_t ocrUs = 50000;
+
+    uint64_t now()
+    {
+        struct timespec spec;
+        clock_gettime(CLOCK_MONOTONIC, &spec);
+        return static_cast<uint64_t>(spec.tv_sec) * 1000000 + spec.tv_nsec / 1000;
+    }
+
+    void spin(useconds_t us)
+    {
+        auto end = now() + us;
+        while (now() < end) {
+        }
+    }
+
+    double run(bool admission, long items, int processors, int workers)
+    {
+        // OCR workers block in usleep(), give them threads of their own
+        executor ex(processors + workers);
+        task_graph graph(ex);
+        auto& ocr = graph.add<long>(workers, [](long&) { usleep(ocrUs); });
+        auto& process = graph.add<long>(processors, [admission, &ocr](long& v) {
+            thread_local unsigned int seed = static_cast<unsigned int>(now());
+            spin(processUs);
+            if (!admission) {
+                usleep(rand_r(&seed) % 200000);
+            }
+            ocr.post(v);
+        });
+        if (admission) {
+            // what OcrHandlerQueue::window() allows: two requests per OCR worker
+            long window = 2 * workers;
+            graph.throttle(process, ocr, [window] { return window; });
+        }
+        auto begin = now();
+        for (long i = 0; i < items; i++) {
+            process.post(i);
+        }
+        graph.wait_idle();
+        double rate = items * 1e6 / (now() - begin);
+        ex.stop();
+        return rate;
+    }
+}  // namespace
+
+int main(int argc, char* argv[])
+{
+    long items = argc > 1 ? atol(argv[1]) : 400;
+    int processors = argc > 2 ? atoi(argv[2]) : 4;
+    int workers = argc > 3 ? atoi(argv[3]) : 8;
+    printf("%ld items, %d processors, %d OCR workers (%u us each)\n",
+           items,
+           processors,
+           workers,
+           ocrUs);
+    printf("random sleep:      %8.1f items/s\n", run(false, items, processors, workers));
+    printf("throttled:         %8.1f items/s\n", run(true, items, processors, workers));
+    return 0;
+}
@@ -1,12 +1,76 @@
-
+// Usage: barCode <image file>
+//        barCode -c <image files...>
+// -c compares the bar code detector shrunk to 1280 pixels (image.barcodeDetectWidth) against
+//    the default full resolution run and times both.
+#include <chrono>
 #include <iostream>
 #include <string>
 #include "image.h"
 
+namespace
+{
+    double ms(std::chrono::steady_clock::time_point begin)
+    {
+        auto d = std::chrono::steady_clock::now() - begin;
+        return std::chrono::duration<double, std::milli>(d).count();
+    }
+
+    int compare(int n, char* files[])
+    {
+        int same = 0, found = 0;
+        double fullMs = 0, fastMs = 0;
+        for (int i = 0; i < n; i++) {
+            cv::Mat board = cv::imread(files[i], cv::IMREAD_COLOR);
+            if (board.empty()) {
+                printf("%s: unreadable\n", files[i]);
+                continue;
+            }
+            cv::Rect full, fast;
+            auto begin = std::chrono::steady_clock::now();
+            int a = fc::findBarCodeROI(board, full, 0);
+            fullMs += ms(begin);
+            begin = std::chrono::steady_clock::now();
+            int b = fc::findBarCodeROI(board, fast, 1280);
+            fastMs += ms(begin);
+
+            double iou = 0;
+            if (a == 0 && b == 0) {
+                double overlap = (full & fast).area();
+                iou = overlap / (full.area() + fast.area() - overlap);
+            }
+            bool match = (a != 0 && b != 0) || iou >= 0.8;
+            same += match;
+            found += a == 0;
+            printf("%s: full %d,%d %dx%d, shrunk %d,%d %dx%d, IoU %.2f%s\n",
+                   files[i],
+                   full.x,
+                   full.y,
+                   full.width,
+                   full.height,
+                   fast.x,
+                   fast.y,
+                   fast.width,
+                   fast.height,
+                   iou,
+                   match ? "" : " DIFFERENT");
+        }
+        printf("%d/%d boards agree, %d with a ROI; %.1f ms full, %.1f ms shrunk per board\n",
+               same,
+               n,
+               found,
+               fullMs / n,
+               fastMs / n);
+        return same == n ? 0 : 1;
+    }
+}  // namespace
+
 int main(int argc, char* argv[])
 {
+    if (argc > 2 && string(argv[1]) == "-c") {
+        return compare(argc - 2, argv + 2);
+    }
     if (argc != 2) {
-        printf("usage: barCode <image file>");
+        printf("usage: barCode <image file>\n       barCode -c <image files...>\n");
         exit(-1);
     }
     fc::Image i(argv[1]);
@@ -0,0 +1,54 @@
+// Times every watermark blend kernel this CPU supports on a marker sized ROI.
+// Usage: blendBench [width] [height] [rounds]
+#include "blend.h"
+
+#include <time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+namespace
+{
+    uint64_t now()
+    {
+        struct timespec spec;
+        clock_gettime(CLOCK_MONOTONIC, &spec);
+        return static_cast<uint64_t>(spec.tv_sec) * 1000000 + spec.tv_nsec / 1000;
+    }
+}  // namespace
+
+int main(int argc, char* argv[])
+{
+    size_t width = argc > 1 ? atol(argv[1]) : 560;
+    size_t height = argc > 2 ? atol(argv[2]) : 210;
+    long rounds = argc > 3 ? atol(argv[3]) : 2000;
+    size_t n = width * height * 3;
+
+    std::vector<uint8_t> base(n), premultiplied(n), inverse(n);
+    for (size_t i = 0; i < n; i++) {
+        base[i] = rand() % 256;
+        inverse[i] = rand() % 256;
+        premultiplied[i] = (255 - inverse[i]) * (rand() % 256) / 255;
+    }
+
+    printf("%zux%zu BGR, %ld rounds, overlay() uses %s\n",
+           width,
+           height,
+           rounds,
+           tb::blend::implementation());
+    for (const char* name : {"scalar", "sse4.1", "avx2"}) {
+        auto k = tb::blend::find(name);
+        if (k == nullptr) {
+            printf("%-8s not supported\n", name);
+            continue;
+        }
+        auto dst = base;
+        auto begin = now();
+        for (long r = 0; r < rounds; r++) {
+            k(dst.data(), premultiplied.data(), inverse.data(), n);
+        }
+        double us = static_cast<double>(now() - begin) / rounds;
+        printf("%-8s %10.1f us/blend %8.2f GB/s\n", name, us, n / us / 1e3);
+    }
+    return 0;
+}